@@ -0,0 +1,267 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include "VTFFormat.h"
+#include "DXTDecompress.h"
+#include "VTFWriter.h"
+#include "VTFBlockCache.h"
+
+// Operations on DXT blocks that stay in the compressed domain
+namespace DXTBlocks {
+
+// Result flags of TranscodeBlock
+enum {
+    kTranscodeExact = 0,
+    kTranscodeLossy = 1,            // Colour or alpha had to be re-encoded
+    kTranscodeAlphaDropped = 2,     // Target cannot store the block's alpha
+};
+
+// The 8-byte colour block inside a DXT block
+using DXT::ColorBlock;
+
+inline uint8_t* ColorBlock(uint8_t* block, VTFImageFormat format) {
+    return (format == IMAGE_FORMAT_DXT3 || format == IMAGE_FORMAT_DXT5) ? block + 8 : block;
+}
+
+// Decodes the alpha of the 16 pixels of a block. Plain DXT1 is opaque, as
+// the loader decodes it.
+inline void DecodeAlpha(const uint8_t* block, VTFImageFormat format, uint8_t* alpha) {
+    uint8_t rgba[64];
+    switch (format) {
+        case IMAGE_FORMAT_DXT1_ONEBITALPHA:
+            DXT::DecompressDXT1Block(block, rgba, 16, true);
+            break;
+        case IMAGE_FORMAT_DXT3:
+            DXT::DecompressDXT3Block(block, rgba, 16);
+            break;
+        case IMAGE_FORMAT_DXT5:
+            DXT::DecompressDXT5Block(block, rgba, 16);
+            break;
+        default:
+            memset(alpha, 255, 16);
+            return;
+    }
+    for (int i = 0; i < 16; i++) alpha[i] = rgba[i * 4 + 3];
+}
+
+// Rewrites a colour block that decodes in four-colour mode so it also
+// decodes that way as DXT1, where color0 <= color1 selects three-colour
+// mode. Swapping the endpoints mirrors the palette, which index ^ 1 undoes;
+// with equal endpoints every entry is the same colour.
+inline void NormalizeColorBlock(uint8_t* color) {
+    uint16_t color0, color1;
+    uint32_t indices;
+    memcpy(&color0, color, 2);
+    memcpy(&color1, color + 2, 2);
+    memcpy(&indices, color + 4, 4);
+    
+    if (color0 < color1) {
+        std::swap(color0, color1);
+        indices ^= 0x55555555;
+    } else if (color0 == color1) {
+        indices = 0;
+    }
+    
+    memcpy(color, &color0, 2);
+    memcpy(color + 2, &color1, 2);
+    memcpy(color + 4, &indices, 4);
+}
+
+// Converts one block between DXT1, DXT1_ONEBITALPHA, DXT3 and DXT5. The
+// colour block is copied verbatim, except DXT1 blocks in three-colour mode
+// (color0 <= color1), which DXT3 and DXT5 can't express: they are remapped
+// exactly when both endpoints are equal and re-encoded otherwise. The
+// alpha block is copied or synthesized from the source alpha. A DXT1A
+// target re-encodes blocks with transparency in three-colour mode from
+// alpha cut to 0 or 255; plain DXT1 drops their alpha.
+// Returns kTranscode* flags.
+inline int TranscodeBlock(const uint8_t* src, VTFImageFormat srcFormat, uint8_t* dst, VTFImageFormat dstFormat) {
+    int result = kTranscodeExact;
+    
+    uint8_t alpha[16];
+    DecodeAlpha(src, srcFormat, alpha);
+    bool opaque = true;
+    bool binary = true;
+    for (int i = 0; i < 16; i++) {
+        if (alpha[i] != 255) opaque = false;
+        if (alpha[i] != 0 && alpha[i] != 255) binary = false;
+    }
+    
+    // Colour
+    uint8_t color[8];
+    memcpy(color, ColorBlock(src, srcFormat), 8);
+    
+    uint16_t color0, color1;
+    memcpy(&color0, color, 2);
+    memcpy(&color1, color + 2, 2);
+    bool isDXT1 = srcFormat == IMAGE_FORMAT_DXT1 || srcFormat == IMAGE_FORMAT_DXT1_ONEBITALPHA;
+    if (isDXT1 && color0 <= color1) {
+        // Three-colour mode: index 2 is the half-way colour and index 3 is
+        // black, transparent in DXT1A and opaque in plain DXT1
+        bool transparent = srcFormat == IMAGE_FORMAT_DXT1_ONEBITALPHA;
+        uint32_t indices;
+        memcpy(&indices, color + 4, 4);
+        
+        if (color0 == color1) {
+            // Indices 0 to 2 are all the one colour. Transparent pixels take
+            // it too; opaque black becomes the second endpoint, which as
+            // 0x0000 sorts below any other colour and keeps four-colour mode.
+            uint32_t remapped = 0;
+            for (int i = 0; i < 16; i++) {
+                if (((indices >> (i * 2)) & 3) == 3 && !transparent && color0 != 0) remapped |= 1u << (i * 2);
+            }
+            color1 = 0;
+            memcpy(color + 2, &color1, 2);
+            memcpy(color + 4, &remapped, 4);
+        } else {
+            // The half-way colour can't be expressed with four-colour
+            // interpolation: re-encode the colour. Transparent pixels take
+            // an opaque colour so black doesn't drag the endpoints.
+            uint8_t rgba[64];
+            DXT::DecompressDXT1Block(color, rgba, 16, true);
+            if (transparent) {
+                int fill = 0;
+                while (fill < 15 && rgba[fill * 4 + 3] == 0) fill++;
+                for (int i = 0; i < 16; i++) {
+                    if (rgba[i * 4 + 3] == 0) memcpy(&rgba[i * 4], &rgba[fill * 4], 3);
+                }
+            }
+            for (int i = 0; i < 16; i++) rgba[i * 4 + 3] = 255;
+            DXTCompress::CompressDXT1Block(rgba, color);
+            result |= kTranscodeLossy;
+        }
+    }
+    NormalizeColorBlock(color);
+    memcpy(ColorBlock(dst, dstFormat), color, 8);
+    
+    // Alpha
+    switch (dstFormat) {
+        case IMAGE_FORMAT_DXT3:
+            if (srcFormat == IMAGE_FORMAT_DXT3) {
+                memcpy(dst, src, 8);
+                break;
+            }
+            memset(dst, 0, 8);
+            for (int i = 0; i < 16; i++) {
+                int nibble = (alpha[i] * 15 + 127) / 255;
+                dst[i / 2] |= nibble << ((i & 1) * 4);
+                if (nibble * 17 != alpha[i]) result |= kTranscodeLossy;
+            }
+            break;
+        
+        case IMAGE_FORMAT_DXT5:
+            if (srcFormat == IMAGE_FORMAT_DXT5) {
+                memcpy(dst, src, 8);
+            } else if (opaque) {
+                // Both endpoints 255, all indices 0
+                memset(dst, 0, 8);
+                dst[0] = dst[1] = 255;
+            } else if (binary) {
+                // alpha0 <= alpha1: index 0 is 0 and index 1 is 255
+                memset(dst, 0, 8);
+                dst[0] = 0;
+                dst[1] = 255;
+                uint64_t indices = 0;
+                for (int i = 0; i < 16; i++) {
+                    if (alpha[i] == 255) indices |= static_cast<uint64_t>(1) << (i * 3);
+                }
+                for (int i = 0; i < 6; i++) dst[2 + i] = (indices >> (i * 8)) & 0xFF;
+            } else {
+                uint8_t rgba[64] = {};
+                for (int i = 0; i < 16; i++) rgba[i * 4 + 3] = alpha[i];
+                DXTCompress::CompressDXT5Alpha(rgba, dst);
+                
+                uint8_t check[16];
+                DecodeAlpha(dst, IMAGE_FORMAT_DXT5, check);
+                if (memcmp(check, alpha, 16) != 0) result |= kTranscodeLossy;
+            }
+            break;
+        
+        case IMAGE_FORMAT_DXT1_ONEBITALPHA:
+            if (!opaque) {
+                // Three-colour block with index 3 for the pixels under half
+                // alpha, re-encoded from the colour above
+                uint8_t rgba[64];
+                DXT::DecompressDXT1Block(color, rgba, 16, false);
+                for (int i = 0; i < 16; i++) rgba[i * 4 + 3] = (alpha[i] >= 128) ? 255 : 0;
+                DXTCompress::CompressDXT1ABlock(rgba, dst);
+                result |= kTranscodeLossy;
+            }
+            break;
+        
+        default:
+            // Plain DXT1 only stores opaque blocks
+            if (!opaque) result |= kTranscodeAlphaDropped;
+            break;
+    }
+    
+    return result;
+}
+
+// Compresses a 4x4 RGBA block to any DXT format. DXT3 takes the colour
+// of the DXT5 encoding and explicit alpha. With a cache, blocks already
+// encoded to the same format are copied from it.
+inline void EncodeBlock(const uint8_t* rgba, VTFImageFormat format, uint8_t* output, VTFBlockCache* cache = nullptr) {
+    size_t blockBytes = GetFormatTraits(format).bytesPerBlock;
+    if (cache && cache->Lookup(rgba, format, output, blockBytes)) return;
+    
+    switch (format) {
+        case IMAGE_FORMAT_DXT5:
+            DXTCompress::CompressDXT5Block(rgba, output);
+            break;
+        case IMAGE_FORMAT_DXT3: {
+            uint8_t dxt5[16];
+            DXTCompress::CompressDXT5Block(rgba, dxt5);
+            TranscodeBlock(dxt5, IMAGE_FORMAT_DXT5, output, IMAGE_FORMAT_DXT3);
+            break;
+        }
+        case IMAGE_FORMAT_DXT1_ONEBITALPHA:
+            DXTCompress::CompressDXT1ABlock(rgba, output);
+            break;
+        default:
+            DXTCompress::CompressDXT1Block(rgba, output);
+            break;
+    }
+    
+    if (cache) cache->Store(rgba, format, output, blockBytes);
+}
+
+// Moves the pixels of a block: destination pixel i takes the colour and
+// alpha of source pixel map[i] (pixels numbered row by row). Endpoints are
+// kept and only the per-pixel indices move, so the result is exact.
+inline void RemapBlock(const uint8_t* src, uint8_t* dst, VTFImageFormat format, const int* map) {
+    // Colour indices, 2 bits per pixel
+    const uint8_t* srcColor = ColorBlock(src, format);
+    uint8_t* dstColor = ColorBlock(dst, format);
+    uint32_t srcIndices, dstIndices = 0;
+    memcpy(&srcIndices, srcColor + 4, 4);
+    for (int i = 0; i < 16; i++) {
+        dstIndices |= ((srcIndices >> (map[i] * 2)) & 3) << (i * 2);
+    }
+    memcpy(dstColor, srcColor, 4);
+    memcpy(dstColor + 4, &dstIndices, 4);
+    
+    if (format == IMAGE_FORMAT_DXT3) {
+        // Explicit alpha, 4 bits per pixel
+        uint64_t srcAlpha, dstAlpha = 0;
+        memcpy(&srcAlpha, src, 8);
+        for (int i = 0; i < 16; i++) {
+            dstAlpha |= ((srcAlpha >> (map[i] * 4)) & 0xF) << (i * 4);
+        }
+        memcpy(dst, &dstAlpha, 8);
+    } else if (format == IMAGE_FORMAT_DXT5) {
+        // Two endpoints, then 3-bit indices in 6 bytes
+        uint64_t srcAlpha = 0, dstAlpha = 0;
+        for (int i = 0; i < 6; i++) srcAlpha |= static_cast<uint64_t>(src[2 + i]) << (i * 8);
+        for (int i = 0; i < 16; i++) {
+            dstAlpha |= ((srcAlpha >> (map[i] * 3)) & 7) << (i * 3);
+        }
+        dst[0] = src[0];
+        dst[1] = src[1];
+        for (int i = 0; i < 6; i++) dst[2 + i] = (dstAlpha >> (i * 8)) & 0xFF;
+    }
+}
+
+} // namespace DXTBlocks
@@ -2,6 +2,9 @@
 
 #include <cstdint>
 #include <cstring>
+#include <type_traits>
+#include "VTFFormat.h"
+#include "VTFPixelConvert.h"
 
 // DXT/BC Texture Decompression Functions
 namespace DXT {
@@ -17,14 +20,8 @@ inline void DecodeColor565(uint16_t color, uint8_t* r, uint8_t* g, uint8_t* b) {
     *b |= *b >> 5;
 }
 
-// Decompress a single DXT1 4x4 block
-inline void DecompressDXT1Block(const uint8_t* src, uint8_t* dst, int dstPitch, bool hasAlpha = false) {
-    uint16_t color0 = *reinterpret_cast<const uint16_t*>(src);
-    uint16_t color1 = *reinterpret_cast<const uint16_t*>(src + 2);
-    uint32_t indices = *reinterpret_cast<const uint32_t*>(src + 4);
-    
-    uint8_t palette[4][4];
-    
+// Build the RGBA palette of a DXT1 colour block
+inline void BuildColorPalette(uint16_t color0, uint16_t color1, bool hasAlpha, uint8_t palette[4][4]) {
     DecodeColor565(color0, &palette[0][0], &palette[0][1], &palette[0][2]);
     palette[0][3] = 255;
     
@@ -48,15 +45,41 @@ inline void DecompressDXT1Block(const uint8_t* src, uint8_t* dst, int dstPitch,
         palette[2][3] = 255;
         palette[3][3] = hasAlpha ? 0 : 255;
     }
+}
+
+// Build the 8-entry palette of a DXT5 alpha block
+inline void BuildAlphaPalette(uint8_t alpha0, uint8_t alpha1, uint8_t palette[8]) {
+    palette[0] = alpha0;
+    palette[1] = alpha1;
+    
+    if (alpha0 > alpha1) {
+        // 8-alpha mode
+        for (int i = 0; i < 6; i++) {
+            palette[i + 2] = ((6 - i) * alpha0 + (i + 1) * alpha1) / 7;
+        }
+    } else {
+        // 6-alpha + 0 + 255 mode
+        for (int i = 0; i < 4; i++) {
+            palette[i + 2] = ((4 - i) * alpha0 + (i + 1) * alpha1) / 5;
+        }
+        palette[6] = 0;
+        palette[7] = 255;
+    }
+}
+
+// Decompress a single DXT1 4x4 block
+inline void DecompressDXT1Block(const uint8_t* src, uint8_t* dst, int dstPitch, bool hasAlpha = false) {
+    uint16_t color0 = *reinterpret_cast<const uint16_t*>(src);
+    uint16_t color1 = *reinterpret_cast<const uint16_t*>(src + 2);
+    uint32_t indices = *reinterpret_cast<const uint32_t*>(src + 4);
+    
+    uint8_t palette[4][4];
+    BuildColorPalette(color0, color1, hasAlpha, palette);
     
     for (int y = 0; y < 4; y++) {
         for (int x = 0; x < 4; x++) {
             int idx = (indices >> ((y * 4 + x) * 2)) & 0x3;
-            uint8_t* pixel = dst + y * dstPitch + x * 4;
-            pixel[0] = palette[idx][0]; // R
-            pixel[1] = palette[idx][1]; // G
-            pixel[2] = palette[idx][2]; // B
-            pixel[3] = palette[idx][3]; // A
+            memcpy(dst + y * dstPitch + x * 4, palette[idx], 4); // RGBA
         }
     }
 }
@@ -90,27 +113,8 @@ inline void DecompressDXT3Block(const uint8_t* src, uint8_t* dst, int dstPitch)
 // Decompress a single DXT5 4x4 block
 inline void DecompressDXT5Block(const uint8_t* src, uint8_t* dst, int dstPitch) {
     // First 8 bytes are alpha block
-    uint8_t alpha0 = src[0];
-    uint8_t alpha1 = src[1];
-    
-    // Build alpha palette
     uint8_t alphaPalette[8];
-    alphaPalette[0] = alpha0;
-    alphaPalette[1] = alpha1;
-    
-    if (alpha0 > alpha1) {
-        // 8-alpha mode
-        for (int i = 0; i < 6; i++) {
-            alphaPalette[i + 2] = ((6 - i) * alpha0 + (i + 1) * alpha1) / 7;
-        }
-    } else {
-        // 6-alpha + 0 + 255 mode
-        for (int i = 0; i < 4; i++) {
-            alphaPalette[i + 2] = ((4 - i) * alpha0 + (i + 1) * alpha1) / 5;
-        }
-        alphaPalette[6] = 0;
-        alphaPalette[7] = 255;
-    }
+    BuildAlphaPalette(src[0], src[1], alphaPalette);
     
     // Read 48 bits of alpha indices
     uint64_t alphaIndices = 0;
@@ -133,64 +137,345 @@ inline void DecompressDXT5Block(const uint8_t* src, uint8_t* dst, int dstPitch)
     }
 }
 
-// Decompress a full DXT image to RGBA
-inline void DecompressDXT(const uint8_t* src, uint8_t* dst, int width, int height, int format) {
-    int blocksX = (width + 3) / 4;
-    int blocksY = (height + 3) / 4;
-    int dstPitch = width * 4;
+// Decompress one block of a format known at compile time
+template <VTFImageFormat Format>
+inline void DecompressBlock(const uint8_t* src, uint8_t* dst, int dstPitch) {
+    if (Format == IMAGE_FORMAT_DXT1 || Format == IMAGE_FORMAT_DXT1_ONEBITALPHA) {
+        DecompressDXT1Block(src, dst, dstPitch, Format == IMAGE_FORMAT_DXT1_ONEBITALPHA);
+    } else if (Format == IMAGE_FORMAT_DXT3) {
+        DecompressDXT3Block(src, dst, dstPitch);
+    } else {
+        DecompressDXT5Block(src, dst, dstPitch);
+    }
+}
+
+// Decompress one block straight into layout Dst. The colour palette is
+// converted to Dst once, so each pixel is a copy of its palette entry;
+// DXT3 and DXT5 alpha is written on top when Dst has an alpha channel.
+template <VTFImageFormat Format, typename Dst>
+inline void DecompressBlockTo(const uint8_t* src, uint8_t* dst, int dstPitch) {
+    const bool explicitAlpha = Format == IMAGE_FORMAT_DXT3 || Format == IMAGE_FORMAT_DXT5;
+    const uint8_t* color = explicitAlpha ? src + 8 : src;
+    
+    uint16_t color0, color1;
+    uint32_t indices;
+    memcpy(&color0, color, 2);
+    memcpy(&color1, color + 2, 2);
+    memcpy(&indices, color + 4, 4);
     
-    // Create a temp buffer for partial blocks at edges
+    uint8_t palette[4][4];
+    BuildColorPalette(color0, color1, Format == IMAGE_FORMAT_DXT1_ONEBITALPHA, palette);
+    uint8_t dstPalette[4 * Dst::kSize];
+    VTFConvertPixels<VTFLayout::RGBA8888, Dst>(palette[0], dstPalette, 4);
+    
+    for (int y = 0; y < 4; y++) {
+        for (int x = 0; x < 4; x++) {
+            int idx = (indices >> ((y * 4 + x) * 2)) & 0x3;
+            memcpy(dst + y * dstPitch + x * Dst::kSize, &dstPalette[idx * Dst::kSize], Dst::kSize);
+        }
+    }
+    
+    if (!explicitAlpha || Dst::kA < 0) return;
+    
+    uint8_t alphaPalette[8];
+    uint64_t alphaIndices = 0;
+    if (Format == IMAGE_FORMAT_DXT5) {
+        BuildAlphaPalette(src[0], src[1], alphaPalette);
+        for (int i = 0; i < 6; i++) alphaIndices |= static_cast<uint64_t>(src[2 + i]) << (i * 8);
+    }
+    
+    for (int y = 0; y < 4; y++) {
+        for (int x = 0; x < 4; x++) {
+            int i = y * 4 + x;
+            uint8_t alpha;
+            if (Format == IMAGE_FORMAT_DXT3) {
+                alpha = (src[i / 2] >> ((i & 1) * 4)) & 0xF;
+                alpha = alpha | (alpha << 4);
+            } else {
+                alpha = alphaPalette[(alphaIndices >> (i * 3)) & 0x7];
+            }
+            VTFWriteChannel<Dst::kA>(dst + y * dstPitch + x * Dst::kSize, alpha);
+        }
+    }
+}
+
+// Edge kernel: decodes a block into a temporary and writes the part that
+// lies inside the image in layout Dst
+template <VTFImageFormat Format, typename Dst>
+inline void DecompressEdgeBlock(const uint8_t* src, uint8_t* dst, int dstPitch, int copyWidth, int copyHeight) {
     uint8_t tempBlock[4 * 4 * 4];
+    DecompressBlock<Format>(src, tempBlock, 16);
+    
+    for (int y = 0; y < copyHeight; y++) {
+        VTFConvertPixels<VTFLayout::RGBA8888, Dst>(tempBlock + y * 16, dst + y * dstPitch, copyWidth);
+    }
+}
+
+// Decompress a full DXT image to layout Dst (RGBA by default). The format
+// is a template parameter, so the per-block dispatch and block size are
+// resolved at compile time. Full blocks decode straight into the image in
+// a loop without bounds checks, RGBA through the plain block decoders and
+// other layouts through DecompressBlockTo; only the last block column and
+// row take the edge kernel.
+template <VTFImageFormat Format, typename Dst = VTFLayout::RGBA8888>
+inline void DecompressDXTImage(const uint8_t* src, uint8_t* dst, int width, int height) {
+    static_assert(GetFormatTraits(Format).compressed, "DecompressDXTImage needs a DXT format");
+    const size_t blockBytes = GetFormatTraits(Format).bytesPerBlock;
+    const bool direct = std::is_same<Dst, VTFLayout::RGBA8888>::value;
+    const int blockStride = 4 * Dst::kSize;
+    
+    int blocksX = (width + 3) / 4;
+    int fullBlocksX = width / 4;
+    int fullBlocksY = height / 4;
+    int edgeWidth = width - fullBlocksX * 4;
+    int edgeHeight = height - fullBlocksY * 4;
+    size_t dstPitch = static_cast<size_t>(width) * Dst::kSize;
     
-    for (int by = 0; by < blocksY; by++) {
+    // Interior block rows
+    for (int by = 0; by < fullBlocksY; by++) {
+        uint8_t* dstRow = dst + by * 4 * dstPitch;
+        
+        for (int bx = 0; bx < fullBlocksX; bx++) {
+            if (direct) {
+                DecompressBlock<Format>(src, dstRow + bx * blockStride, static_cast<int>(dstPitch));
+            } else {
+                DecompressBlockTo<Format, Dst>(src, dstRow + bx * blockStride, static_cast<int>(dstPitch));
+            }
+            src += blockBytes;
+        }
+        
+        if (edgeWidth > 0) {
+            DecompressEdgeBlock<Format, Dst>(src, dstRow + fullBlocksX * blockStride, static_cast<int>(dstPitch), edgeWidth, 4);
+            src += blockBytes;
+        }
+    }
+    
+    // Partial last block row
+    if (edgeHeight > 0) {
+        uint8_t* dstRow = dst + fullBlocksY * 4 * dstPitch;
+        
         for (int bx = 0; bx < blocksX; bx++) {
-            int blockX = bx * 4;
-            int blockY = by * 4;
-            
-            // Check if this is a partial block at the edge
-            bool isPartial = (blockX + 4 > width) || (blockY + 4 > height);
+            int copyWidth = (bx < fullBlocksX) ? 4 : edgeWidth;
+            DecompressEdgeBlock<Format, Dst>(src, dstRow + bx * blockStride, static_cast<int>(dstPitch), copyWidth, edgeHeight);
+            src += blockBytes;
+        }
+    }
+}
+
+// Decompress a full DXT image to layout Dst (RGBA by default), dispatching
+// once on the format
+template <typename Dst = VTFLayout::RGBA8888>
+inline void DecompressDXT(const uint8_t* src, uint8_t* dst, int width, int height, VTFImageFormat format) {
+    switch (format) {
+        case IMAGE_FORMAT_DXT1:
+            DecompressDXTImage<IMAGE_FORMAT_DXT1, Dst>(src, dst, width, height);
+            break;
+        case IMAGE_FORMAT_DXT1_ONEBITALPHA:
+            DecompressDXTImage<IMAGE_FORMAT_DXT1_ONEBITALPHA, Dst>(src, dst, width, height);
+            break;
+        case IMAGE_FORMAT_DXT3:
+            DecompressDXTImage<IMAGE_FORMAT_DXT3, Dst>(src, dst, width, height);
+            break;
+        case IMAGE_FORMAT_DXT5:
+            DecompressDXTImage<IMAGE_FORMAT_DXT5, Dst>(src, dst, width, height);
+            break;
+        default:
+            break;
+    }
+}
+
+// Block statistics. These work on the palette and on how many pixels use
+// each index, counted with popcounts over the index bit planes, so no
+// pixel is decoded. A pixel mask (bit i for pixel i, row by row) limits
+// the counts to the pixels inside the image for edge blocks.
+
+// Mask of the pixels of an edge block that lie inside the image
+inline uint16_t BlockPixelMask(int columns, int rows) {
+    uint16_t rowMask = static_cast<uint16_t>((1 << columns) - 1);
+    uint16_t mask = 0;
+    for (int y = 0; y < rows; y++) mask |= rowMask << (y * 4);
+    return mask;
+}
+
+// Spreads a pixel mask to the lowest bit of each 'bits'-wide index lane
+inline uint64_t SpreadPixelMask(uint16_t mask, int bits) {
+    uint64_t lanes = 0;
+    for (int i = 0; i < 16; i++) {
+        if (mask & (1 << i)) lanes |= static_cast<uint64_t>(1) << (i * bits);
+    }
+    return lanes;
+}
+
+// Number of set bits
+inline int PopCount(uint64_t x) {
+    x = x - ((x >> 1) & 0x5555555555555555ull);
+    x = (x & 0x3333333333333333ull) + ((x >> 2) & 0x3333333333333333ull);
+    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0Full;
+    return static_cast<int>((x * 0x0101010101010101ull) >> 56);
+}
+
+// Pixels using each of the four indices of a colour block
+inline void CountColorIndices(const uint8_t* color, int counts[4], uint16_t mask = 0xFFFF) {
+    uint32_t lanes = (mask == 0xFFFF) ? 0x55555555 : static_cast<uint32_t>(SpreadPixelMask(mask, 2));
+    uint32_t indices;
+    memcpy(&indices, color + 4, 4);
+    uint32_t low = indices & lanes;
+    uint32_t high = (indices >> 1) & lanes;
+    counts[3] = PopCount(low & high);
+    counts[1] = PopCount(low) - counts[3];
+    counts[2] = PopCount(high) - counts[3];
+    counts[0] = PopCount(lanes) - counts[1] - counts[2] - counts[3];
+}
+
+// Pixels using each of the eight indices of a DXT5 alpha block: the three
+// bit planes ANDed together, each as is or inverted per the index's bits
+inline void CountAlphaIndices(const uint8_t* alpha, int counts[8], uint16_t mask = 0xFFFF) {
+    uint64_t indices = 0;
+    for (int i = 0; i < 6; i++) indices |= static_cast<uint64_t>(alpha[2 + i]) << (i * 8);
+    
+    const uint64_t lanes = (mask == 0xFFFF) ? 0x249249249249ull : SpreadPixelMask(mask, 3);
+    uint64_t planes[3] = { indices & lanes, (indices >> 1) & lanes, (indices >> 2) & lanes };
+    for (int value = 0; value < 8; value++) {
+        uint64_t match = lanes;
+        for (int bit = 0; bit < 3; bit++) {
+            match &= (value & (1 << bit)) ? planes[bit] : ~planes[bit];
+        }
+        counts[value] = PopCount(match);
+    }
+}
+
+// The 8-byte colour block inside a DXT block
+inline const uint8_t* ColorBlock(const uint8_t* block, VTFImageFormat format) {
+    return (format == IMAGE_FORMAT_DXT3 || format == IMAGE_FORMAT_DXT5) ? block + 8 : block;
+}
+
+// Sum of the alpha of a block's pixels (all 16 unless masked), and how it
+// is used. Plain DXT1 is opaque, as the loader decodes it.
+inline int SumBlockAlpha(const uint8_t* block, VTFImageFormat format, VTFAlphaClass* alphaClass,
+                         uint16_t mask = 0xFFFF) {
+    int pixels = PopCount(mask);
+    switch (format) {
+        case IMAGE_FORMAT_DXT1_ONEBITALPHA: {
+            // Index 3 is transparent in three-colour mode
+            uint16_t color0, color1;
+            memcpy(&color0, block, 2);
+            memcpy(&color1, block + 2, 2);
+            int counts[4];
+            CountColorIndices(block, counts, mask);
+            int transparent = (color0 <= color1) ? counts[3] : 0;
+            *alphaClass = transparent ? ALPHA_CLASS_ONEBIT : ALPHA_CLASS_OPAQUE;
+            return (pixels - transparent) * 255;
+        }
+        
+        case IMAGE_FORMAT_DXT3: {
+            // Sum of the 4-bit values, one bit plane at a time. A nibble is
+            // 0xF when all its bits are set and 0 when none is.
+            uint64_t alpha;
+            memcpy(&alpha, block, 8);
+            const uint64_t lanes = (mask == 0xFFFF) ? 0x1111111111111111ull : SpreadPixelMask(mask, 4);
+            alpha &= lanes * 0xF;
+            int sum = 0;
+            for (int bit = 0; bit < 4; bit++) sum += PopCount(alpha & (lanes << bit)) << bit;
             
-            uint8_t* dstBlock;
-            int dstBlockPitch;
+            uint64_t full = alpha & (alpha >> 1) & (alpha >> 2) & (alpha >> 3) & lanes;
+            uint64_t nonzero = (alpha | (alpha >> 1) | (alpha >> 2) | (alpha >> 3)) & lanes;
+            *alphaClass = (full == lanes) ? ALPHA_CLASS_OPAQUE
+                        : (full == nonzero) ? ALPHA_CLASS_ONEBIT : ALPHA_CLASS_EIGHTBIT;
+            return sum * 17;
+        }
+        
+        case IMAGE_FORMAT_DXT5: {
+            int counts[8];
+            CountAlphaIndices(block, counts, mask);
             
-            if (isPartial) {
-                dstBlock = tempBlock;
-                dstBlockPitch = 16; // 4 pixels * 4 bytes
-            } else {
-                dstBlock = dst + blockY * dstPitch + blockX * 4;
-                dstBlockPitch = dstPitch;
+            // Opaque blocks are almost always both endpoints at 255, where
+            // only index 6 (0) isn't opaque
+            if (block[0] == 255 && block[1] == 255 && counts[6] == 0) {
+                *alphaClass = ALPHA_CLASS_OPAQUE;
+                return pixels * 255;
             }
             
-            // Decompress based on format
-            switch (format) {
-                case 13: // IMAGE_FORMAT_DXT1
-                case 20: // IMAGE_FORMAT_DXT1_ONEBITALPHA
-                    DecompressDXT1Block(src, dstBlock, dstBlockPitch, format == 20);
-                    src += 8;
-                    break;
-                case 14: // IMAGE_FORMAT_DXT3
-                    DecompressDXT3Block(src, dstBlock, dstBlockPitch);
-                    src += 16;
-                    break;
-                case 15: // IMAGE_FORMAT_DXT5
-                    DecompressDXT5Block(src, dstBlock, dstBlockPitch);
-                    src += 16;
-                    break;
-            }
+            uint8_t palette[8];
+            BuildAlphaPalette(block[0], block[1], palette);
             
-            // Copy partial block to destination
-            if (isPartial) {
-                int copyWidth = (blockX + 4 <= width) ? 4 : (width - blockX);
-                int copyHeight = (blockY + 4 <= height) ? 4 : (height - blockY);
-                
-                for (int y = 0; y < copyHeight; y++) {
-                    memcpy(dst + (blockY + y) * dstPitch + blockX * 4,
-                           tempBlock + y * 16,
-                           copyWidth * 4);
-                }
+            int sum = 0;
+            bool opaque = true;
+            bool binary = true;
+            for (int i = 0; i < 8; i++) {
+                if (counts[i] == 0) continue;
+                sum += counts[i] * palette[i];
+                if (palette[i] != 255) opaque = false;
+                if (palette[i] != 0 && palette[i] != 255) binary = false;
+            }
+            *alphaClass = opaque ? ALPHA_CLASS_OPAQUE : binary ? ALPHA_CLASS_ONEBIT : ALPHA_CLASS_EIGHTBIT;
+            return sum;
+        }
+        
+        default:
+            *alphaClass = ALPHA_CLASS_OPAQUE;
+            return pixels * 255;
+    }
+}
+
+// Whether every pixel of a block is opaque. Cheaper than SumBlockAlpha for
+// the common cases, for scanning whole images.
+inline bool IsBlockOpaque(const uint8_t* block, VTFImageFormat format) {
+    switch (format) {
+        case IMAGE_FORMAT_DXT1_ONEBITALPHA: {
+            uint16_t color0, color1;
+            memcpy(&color0, block, 2);
+            memcpy(&color1, block + 2, 2);
+            if (color0 > color1) return true;
+            int counts[4];
+            CountColorIndices(block, counts);
+            return counts[3] == 0;
+        }
+        
+        case IMAGE_FORMAT_DXT3: {
+            uint64_t alpha;
+            memcpy(&alpha, block, 8);
+            return alpha == ~static_cast<uint64_t>(0);
+        }
+        
+        case IMAGE_FORMAT_DXT5: {
+            if (block[0] == 255 && block[1] == 255) {
+                // Only index 6 (binary 110) isn't opaque
+                uint64_t indices = 0;
+                for (int i = 0; i < 6; i++) indices |= static_cast<uint64_t>(block[2 + i]) << (i * 8);
+                const uint64_t lanes = 0x249249249249ull;
+                return (~indices & (indices >> 1) & (indices >> 2) & lanes) == 0;
             }
+            VTFAlphaClass alphaClass;
+            SumBlockAlpha(block, format, &alphaClass);
+            return alphaClass == ALPHA_CLASS_OPAQUE;
         }
+        
+        default:
+            return true;
     }
 }
 
+// Average colour and alpha of a block's 16 pixels. Equals the average of
+// the decoded block up to rounding.
+inline void AverageBlock(const uint8_t* block, VTFImageFormat format, uint8_t* rgba) {
+    const uint8_t* color = ColorBlock(block, format);
+    uint16_t color0, color1;
+    memcpy(&color0, color, 2);
+    memcpy(&color1, color + 2, 2);
+    
+    uint8_t palette[4][4];
+    BuildColorPalette(color0, color1, format == IMAGE_FORMAT_DXT1_ONEBITALPHA, palette);
+    int counts[4];
+    CountColorIndices(color, counts);
+    
+    for (int c = 0; c < 3; c++) {
+        int sum = 0;
+        for (int i = 0; i < 4; i++) sum += counts[i] * palette[i][c];
+        rgba[c] = static_cast<uint8_t>((sum + 8) / 16);
+    }
+    
+    VTFAlphaClass alphaClass;
+    rgba[3] = static_cast<uint8_t>((SumBlockAlpha(block, format, &alphaClass) + 8) / 16);
+}
+
 } // namespace DXT
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+// Allocation hooks for the codec's pixel and file buffers. By default they
+// use malloc/free; a host can install its own so large buffers are drawn
+// from (and counted against) its memory manager. Hooks must be installed
+// while no codec buffers are alive, or stay able to free blocks they
+// handed out earlier.
+struct VTFAllocatorHooks {
+    // Returns nullptr on failure
+    void* (*allocate)(size_t size, void* context);
+    void (*deallocate)(void* ptr, size_t size, void* context);
+    void* context;
+};
+
+class VTFAllocator {
+public:
+    // Installs hooks; nullptr restores malloc/free
+    static void SetHooks(const VTFAllocatorHooks* hooks);
+    
+    // Throws std::bad_alloc on failure
+    static void* Allocate(size_t size);
+    static void Deallocate(void* ptr, size_t size);
+
+private:
+    static VTFAllocatorHooks& Hooks();
+    static void* DefaultAllocate(size_t size, void*) { return malloc(size); }
+    static void DefaultDeallocate(void* ptr, size_t, void*) { free(ptr); }
+};
+
+// STL allocator routed through VTFAllocator
+template <typename T>
+class VTFStdAllocator {
+public:
+    typedef T value_type;
+    
+    VTFStdAllocator() {}
+    template <typename U> VTFStdAllocator(const VTFStdAllocator<U>&) {}
+    
+    T* allocate(size_t count) {
+        return static_cast<T*>(VTFAllocator::Allocate(count * sizeof(T)));
+    }
+    void deallocate(T* ptr, size_t count) {
+        VTFAllocator::Deallocate(ptr, count * sizeof(T));
+    }
+};
+
+template <typename T, typename U>
+inline bool operator==(const VTFStdAllocator<T>&, const VTFStdAllocator<U>&) { return true; }
+template <typename T, typename U>
+inline bool operator!=(const VTFStdAllocator<T>&, const VTFStdAllocator<U>&) { return false; }
+
+// Byte buffer type used for codec-owned image and file data
+typedef std::vector<uint8_t, VTFStdAllocator<uint8_t>> VTFByteVector;
+
+// Implementation
+inline VTFAllocatorHooks& VTFAllocator::Hooks() {
+    static VTFAllocatorHooks hooks = { &DefaultAllocate, &DefaultDeallocate, nullptr };
+    return hooks;
+}
+
+inline void VTFAllocator::SetHooks(const VTFAllocatorHooks* hooks) {
+    if (hooks) {
+        Hooks() = *hooks;
+    } else {
+        Hooks().allocate = &DefaultAllocate;
+        Hooks().deallocate = &DefaultDeallocate;
+        Hooks().context = nullptr;
+    }
+}
+
+inline void* VTFAllocator::Allocate(size_t size) {
+    if (size == 0) size = 1;
+    
+    const VTFAllocatorHooks& hooks = Hooks();
+    void* ptr = hooks.allocate(size, hooks.context);
+    if (!ptr) throw std::bad_alloc();
+    return ptr;
+}
+
+inline void VTFAllocator::Deallocate(void* ptr, size_t size) {
+    if (!ptr) return;
+    
+    const VTFAllocatorHooks& hooks = Hooks();
+    hooks.deallocate(ptr, size ? size : 1, hooks.context);
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "VTFHash.h"
+
+// Content-addressed cache of encoded DXT blocks. Texture sets repeat a lot
+// of 4x4 blocks (padding, solid masks, trim sheets, tiled detail), so an
+// encoder can look a block up before compressing it and store the result
+// afterwards. Entries are keyed by the 64 bytes of RGBA input plus the
+// encoder settings; the input is kept with the entry, so a hash collision
+// is a miss rather than a wrong block.
+//
+// The cache is split into shards with their own lock, so block rows encoded
+// in parallel rarely contend. Each shard holds a fixed number of entries
+// and replaces the oldest one when full.
+class VTFBlockCache {
+public:
+    static const int kShardCount = 16;
+    static const size_t kMaxEncodedSize = 16;
+    
+    explicit VTFBlockCache(size_t maxEntries = 256 * 1024);
+    
+    VTFBlockCache(const VTFBlockCache&) = delete;
+    VTFBlockCache& operator=(const VTFBlockCache&) = delete;
+    
+    // Copies the encoded block for 'rgba' (16 pixels) into 'encoded' and
+    // returns true if it is cached. 'settings' identifies the encoder
+    // configuration, e.g. the output format.
+    bool Lookup(const uint8_t* rgba, uint32_t settings, uint8_t* encoded, size_t encodedSize);
+    
+    // Adds an encoded block (at most kMaxEncodedSize bytes)
+    void Store(const uint8_t* rgba, uint32_t settings, const uint8_t* encoded, size_t encodedSize);
+    
+    // Drops every entry and resets the counters
+    void Clear();
+    
+    uint64_t GetHits() const { return m_hits; }
+    uint64_t GetMisses() const { return m_misses; }
+    size_t GetMaxEntries() const { return m_shardCapacity * kShardCount; }
+
+private:
+    struct Entry {
+        uint64_t key;
+        uint32_t settings;
+        uint8_t rgba[64];
+        uint8_t encoded[kMaxEncodedSize];
+    };
+    
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<uint64_t, uint32_t> index;
+        std::vector<Entry> entries;
+        uint32_t next = 0;
+    };
+    
+    static uint64_t Key(const uint8_t* rgba, uint32_t settings) {
+        return VTFHash::Compute(rgba, 64, settings);
+    }
+    Shard& ShardFor(uint64_t key) { return m_shards[key >> 60]; }
+    
+    size_t m_shardCapacity;
+    Shard m_shards[kShardCount];
+    std::atomic<uint64_t> m_hits;
+    std::atomic<uint64_t> m_misses;
+};
+
+// Implementation
+inline VTFBlockCache::VTFBlockCache(size_t maxEntries)
+    : m_shardCapacity((maxEntries + kShardCount - 1) / kShardCount), m_hits(0), m_misses(0) {
+    if (m_shardCapacity == 0) m_shardCapacity = 1;
+}
+
+inline bool VTFBlockCache::Lookup(const uint8_t* rgba, uint32_t settings, uint8_t* encoded, size_t encodedSize) {
+    uint64_t key = Key(rgba, settings);
+    Shard& shard = ShardFor(key);
+    
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.index.find(key);
+        if (it != shard.index.end()) {
+            const Entry& entry = shard.entries[it->second];
+            if (entry.settings == settings && memcmp(entry.rgba, rgba, 64) == 0) {
+                memcpy(encoded, entry.encoded, encodedSize);
+                m_hits++;
+                return true;
+            }
+        }
+    }
+    
+    m_misses++;
+    return false;
+}
+
+inline void VTFBlockCache::Store(const uint8_t* rgba, uint32_t settings, const uint8_t* encoded, size_t encodedSize) {
+    if (encodedSize > kMaxEncodedSize) return;
+    
+    uint64_t key = Key(rgba, settings);
+    Shard& shard = ShardFor(key);
+    
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (shard.index.count(key)) return;
+    
+    uint32_t slot;
+    if (shard.entries.size() < m_shardCapacity) {
+        slot = static_cast<uint32_t>(shard.entries.size());
+        shard.entries.emplace_back();
+    } else {
+        // Full: replace the oldest entry
+        slot = shard.next;
+        shard.next = static_cast<uint32_t>((shard.next + 1) % m_shardCapacity);
+        shard.index.erase(shard.entries[slot].key);
+    }
+    
+    Entry& entry = shard.entries[slot];
+    entry.key = key;
+    entry.settings = settings;
+    memcpy(entry.rgba, rgba, 64);
+    memcpy(entry.encoded, encoded, encodedSize);
+    shard.index[key] = slot;
+}
+
+inline void VTFBlockCache::Clear() {
+    for (Shard& shard : m_shards) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.index.clear();
+        std::vector<Entry>().swap(shard.entries);
+        shard.next = 0;
+    }
+    m_hits = 0;
+    m_misses = 0;
+}
@@ -0,0 +1,194 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <new>
+#include <vector>
+#include "VTFAllocator.h"
+
+// Cache of large, 64-byte aligned buffers shared across open/save
+// operations, allocated through VTFAllocator. Sizes are rounded up to size classes (four per power of
+// two), and released buffers are kept for reuse while the cached total
+// stays under the high-water mark. Batch runs over similar images then
+// stop allocating and faulting in fresh pages for every file.
+class VTFBufferArena {
+public:
+    static const size_t kAlignment = 64;
+    static const size_t kMinClassSize = 64 * 1024;
+    
+    explicit VTFBufferArena(size_t highWaterMark = 512 * 1024 * 1024)
+        : m_highWaterMark(highWaterMark), m_cachedBytes(0) {}
+    ~VTFBufferArena() { Trim(0); }
+    
+    // Largest number of bytes kept cached; lowering it trims immediately
+    void SetHighWaterMark(size_t bytes);
+    size_t GetHighWaterMark() const { return m_highWaterMark; }
+    size_t GetCachedBytes() const { return m_cachedBytes; }
+    
+    // Returns a buffer of at least 'size' bytes and its real capacity
+    uint8_t* Acquire(size_t size, size_t& capacity);
+    
+    // Hands a buffer back for reuse, freeing it if the cache is full
+    void Release(uint8_t* data, size_t capacity);
+    
+    // Frees cached buffers until at most 'bytes' remain
+    void Trim(size_t bytes);
+    
+    // Size class a request is rounded up to
+    static size_t RoundToClass(size_t size);
+    
+    // Uncached aligned allocation, for buffers without an arena
+    static uint8_t* AllocateAligned(size_t size);
+    static void FreeAligned(uint8_t* data, size_t size);
+
+private:
+    size_t m_highWaterMark;
+    size_t m_cachedBytes;
+    std::map<size_t, std::vector<uint8_t*>> m_free;
+    std::mutex m_mutex;
+};
+
+// Byte buffer whose storage comes from a VTFBufferArena. It mirrors the
+// parts of std::vector<uint8_t> the plugin uses, but clear() keeps the
+// storage and release() hands it back to the arena instead of the heap.
+class VTFArenaBuffer {
+public:
+    explicit VTFArenaBuffer(VTFBufferArena* arena = nullptr) : m_arena(arena) {}
+    ~VTFArenaBuffer() { release(); }
+    
+    VTFArenaBuffer(const VTFArenaBuffer&) = delete;
+    VTFArenaBuffer& operator=(const VTFArenaBuffer&) = delete;
+    
+    void SetArena(VTFBufferArena* arena) { release(); m_arena = arena; }
+    
+    // Contents up to min(old, new) size are preserved
+    void resize(size_t size);
+    void clear() { m_size = 0; }
+    void release();
+    
+    uint8_t* data() { return m_data; }
+    const uint8_t* data() const { return m_data; }
+    size_t size() const { return m_size; }
+    size_t capacity() const { return m_capacity; }
+    bool empty() const { return m_size == 0; }
+
+private:
+    VTFBufferArena* m_arena;
+    uint8_t* m_data = nullptr;
+    size_t m_size = 0;
+    size_t m_capacity = 0;
+};
+
+// Implementation
+inline size_t VTFBufferArena::RoundToClass(size_t size) {
+    if (size <= kMinClassSize) return kMinClassSize;
+    
+    // Four classes per power of two keeps waste under 25%
+    size_t top = kMinClassSize;
+    while (top < size) top <<= 1;
+    size_t step = top / 8;
+    return (size + step - 1) / step * step;
+}
+
+inline uint8_t* VTFBufferArena::AllocateAligned(size_t size) {
+    // Over-allocate and stash the original pointer just below the block
+    uint8_t* raw = static_cast<uint8_t*>(VTFAllocator::Allocate(size + kAlignment + sizeof(void*)));
+    
+    uintptr_t aligned = (reinterpret_cast<uintptr_t>(raw) + sizeof(void*) + kAlignment - 1) & ~(kAlignment - 1);
+    reinterpret_cast<void**>(aligned)[-1] = raw;
+    return reinterpret_cast<uint8_t*>(aligned);
+}
+
+inline void VTFBufferArena::FreeAligned(uint8_t* data, size_t size) {
+    if (data) VTFAllocator::Deallocate(reinterpret_cast<void**>(data)[-1], size + kAlignment + sizeof(void*));
+}
+
+inline void VTFBufferArena::SetHighWaterMark(size_t bytes) {
+    m_highWaterMark = bytes;
+    Trim(bytes);
+}
+
+inline uint8_t* VTFBufferArena::Acquire(size_t size, size_t& capacity) {
+    capacity = RoundToClass(size);
+    
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_free.find(capacity);
+        if (it != m_free.end() && !it->second.empty()) {
+            uint8_t* data = it->second.back();
+            it->second.pop_back();
+            m_cachedBytes -= capacity;
+            return data;
+        }
+    }
+    
+    return AllocateAligned(capacity);
+}
+
+inline void VTFBufferArena::Release(uint8_t* data, size_t capacity) {
+    if (!data) return;
+    
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_cachedBytes + capacity <= m_highWaterMark) {
+            m_free[capacity].push_back(data);
+            m_cachedBytes += capacity;
+            return;
+        }
+    }
+    
+    FreeAligned(data, capacity);
+}
+
+inline void VTFBufferArena::Trim(size_t bytes) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    
+    // Largest buffers go first
+    for (auto it = m_free.rbegin(); it != m_free.rend() && m_cachedBytes > bytes; ++it) {
+        std::vector<uint8_t*>& list = it->second;
+        while (!list.empty() && m_cachedBytes > bytes) {
+            FreeAligned(list.back(), it->first);
+            list.pop_back();
+            m_cachedBytes -= it->first;
+        }
+    }
+}
+
+inline void VTFArenaBuffer::resize(size_t size) {
+    if (size <= m_capacity) {
+        m_size = size;
+        return;
+    }
+    
+    size_t capacity = 0;
+    uint8_t* data = nullptr;
+    if (m_arena) {
+        data = m_arena->Acquire(size, capacity);
+    } else {
+        capacity = VTFBufferArena::RoundToClass(size);
+        data = VTFBufferArena::AllocateAligned(capacity);
+    }
+    
+    if (m_size > 0) memcpy(data, m_data, m_size);
+    release();
+    
+    m_data = data;
+    m_size = size;
+    m_capacity = capacity;
+}
+
+inline void VTFArenaBuffer::release() {
+    if (m_data) {
+        if (m_arena) {
+            m_arena->Release(m_data, m_capacity);
+        } else {
+            VTFBufferArena::FreeAligned(m_data, m_capacity);
+        }
+    }
+    m_data = nullptr;
+    m_size = 0;
+    m_capacity = 0;
+}
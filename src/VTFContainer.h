@@ -0,0 +1,317 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "VTFFormat.h"
+#include "VTFAllocator.h"
+
+// A VTF file split into the parts that file-level transforms work on: the
+// header, the low-res thumbnail, the high-res image data and, from 7.3 on,
+// the resource dictionary with any other resource chunks. Transforms edit
+// the header and image data; Serialize() lays the file out again and
+// recomputes the header size and resource offsets.
+class VTFContainer {
+public:
+    // Resource tags (7.3+)
+    static const uint32_t kResourceLowRes = 0x01;
+    static const uint32_t kResourceHighRes = 0x30;
+    
+    // Resource flag: the entry holds its value instead of an offset
+    static const uint8_t kResourceNoData = 0x02;
+    
+    bool Parse(const uint8_t* data, size_t size);
+    void Serialize(VTFByteVector& output) const;
+    
+    // Starts a new 7.2 texture with zeroed image data and no thumbnail
+    void Create(int width, int height, VTFImageFormat format, int mipCount);
+    
+    // Changes the dimensions and mip count and reallocates the image data,
+    // zeroed. Frames, faces, depth and the rest of the header are kept.
+    void ResizeImage(int width, int height, int mipCount);
+    
+    // Removes the thumbnail, e.g. when it no longer matches the image
+    void ClearLowRes();
+    
+    // Sets the thumbnail, adding its resource entry where needed
+    void SetLowRes(VTFImageFormat format, int width, int height, VTFByteVector data);
+    bool HasLowRes() const { return !m_lowRes.empty(); }
+    
+    VTFHeader& GetHeader() { return m_header; }
+    const VTFHeader& GetHeader() const { return m_header; }
+    VTFImageFormat GetFormat() const { return static_cast<VTFImageFormat>(m_header.highResImageFormat); }
+    int GetMipmapCount() const { return m_header.mipmapCount > 0 ? m_header.mipmapCount : 1; }
+    
+    // Dimensions of a mip level
+    int GetMipWidth(int mip) const { return (m_header.width >> mip) > 1 ? m_header.width >> mip : 1; }
+    int GetMipHeight(int mip) const { return (m_header.height >> mip) > 1 ? m_header.height >> mip : 1; }
+    
+    // Images (frames x faces x depth slices) stored per mip level
+    int GetImageCount(int mip) const;
+    
+    // Offset of a mip level within the high-res data. Levels are stored
+    // smallest first, so mip 0 comes last.
+    size_t GetMipOffset(int mip) const;
+    
+    // All mips, frames, faces and slices, in file order
+    VTFByteVector& GetHighResData() { return m_highRes; }
+    const VTFByteVector& GetHighResData() const { return m_highRes; }
+    
+    VTFByteVector& GetLowResData() { return m_lowRes; }
+    const VTFByteVector& GetLowResData() const { return m_lowRes; }
+    
+    const std::string& GetError() const { return m_error; }
+    void SetError(const std::string& error) { m_error = error; }
+
+private:
+    struct Resource {
+        uint8_t tag[3];
+        uint8_t flags;
+        uint32_t value;             // Inline value (kResourceNoData)
+        VTFByteVector chunk;        // Size-prefixed data of other resources
+        
+        uint32_t Tag() const { return tag[0] | (tag[1] << 8) | (tag[2] << 16); }
+    };
+    
+    bool HasResources() const { return m_header.version[0] == 7 && m_header.version[1] >= 3; }
+    
+    VTFHeader m_header;
+    size_t m_headerSize = 0;
+    std::vector<Resource> m_resources;
+    VTFByteVector m_lowRes;
+    VTFByteVector m_highRes;
+    std::string m_error;
+};
+
+// Implementation
+inline int VTFContainer::GetImageCount(int mip) const {
+    int depth = GetDepth(m_header) >> mip;
+    if (depth < 1) depth = 1;
+    int frames = m_header.frames > 0 ? m_header.frames : 1;
+    return frames * GetFaceCount(m_header) * depth;
+}
+
+inline size_t VTFContainer::GetMipOffset(int mip) const {
+    size_t offset = 0;
+    for (int level = GetMipmapCount() - 1; level > mip; level--) {
+        offset += CalculateMipSize(m_header, level);
+    }
+    return offset;
+}
+
+inline void VTFContainer::Create(int width, int height, VTFImageFormat format, int mipCount) {
+    memset(&m_header, 0, sizeof(m_header));
+    memcpy(m_header.signature, "VTF", 4);
+    m_header.version[0] = 7;
+    m_header.version[1] = 2;
+    m_header.headerSize = sizeof(VTFHeader);
+    m_header.frames = 1;
+    m_header.reflectivity[0] = m_header.reflectivity[1] = m_header.reflectivity[2] = 0.5f;
+    m_header.bumpmapScale = 1.0f;
+    m_header.highResImageFormat = static_cast<uint32_t>(format);
+    m_header.lowResImageFormat = static_cast<uint32_t>(IMAGE_FORMAT_NONE);
+    m_header.depth = 1;
+    m_headerSize = sizeof(VTFHeader);
+    
+    m_resources.clear();
+    m_lowRes.clear();
+    m_error.clear();
+    ResizeImage(width, height, mipCount);
+}
+
+inline void VTFContainer::ResizeImage(int width, int height, int mipCount) {
+    m_header.width = static_cast<uint16_t>(width);
+    m_header.height = static_cast<uint16_t>(height);
+    m_header.mipmapCount = static_cast<uint8_t>(mipCount);
+    m_highRes.assign(CalculateHighResSize(m_header), 0);
+}
+
+inline void VTFContainer::ClearLowRes() {
+    m_header.lowResImageFormat = static_cast<uint32_t>(IMAGE_FORMAT_NONE);
+    m_header.lowResImageWidth = 0;
+    m_header.lowResImageHeight = 0;
+    m_lowRes.clear();
+    
+    for (size_t i = 0; i < m_resources.size(); i++) {
+        if (m_resources[i].Tag() == kResourceLowRes) {
+            m_resources.erase(m_resources.begin() + i);
+            break;
+        }
+    }
+}
+
+inline void VTFContainer::SetLowRes(VTFImageFormat format, int width, int height, VTFByteVector data) {
+    m_header.lowResImageFormat = static_cast<uint32_t>(format);
+    m_header.lowResImageWidth = static_cast<uint8_t>(width);
+    m_header.lowResImageHeight = static_cast<uint8_t>(height);
+    m_lowRes.swap(data);
+    
+    if (!HasResources()) return;
+    for (const Resource& resource : m_resources) {
+        if (resource.Tag() == kResourceLowRes) return;
+    }
+    
+    // The thumbnail conventionally comes first
+    Resource resource;
+    resource.tag[0] = kResourceLowRes & 0xFF;
+    resource.tag[1] = (kResourceLowRes >> 8) & 0xFF;
+    resource.tag[2] = (kResourceLowRes >> 16) & 0xFF;
+    resource.flags = 0;
+    resource.value = 0;
+    m_resources.insert(m_resources.begin(), std::move(resource));
+}
+
+inline bool VTFContainer::Parse(const uint8_t* data, size_t size) {
+    m_resources.clear();
+    m_lowRes.clear();
+    m_highRes.clear();
+    
+    // 7.0 and 7.1 headers are shorter than the struct; the rest stays zero
+    memset(&m_header, 0, sizeof(m_header));
+    if (size < 16) {
+        m_error = "File too small for VTF header";
+        return false;
+    }
+    memcpy(&m_header, data, size < sizeof(VTFHeader) ? size : sizeof(VTFHeader));
+    
+    if (memcmp(m_header.signature, "VTF", 4) != 0) {
+        m_error = "Invalid VTF signature";
+        return false;
+    }
+    if (m_header.version[0] != 7 || m_header.version[1] > 5) {
+        m_error = "Unsupported VTF version";
+        return false;
+    }
+    
+    m_headerSize = m_header.headerSize;
+    if (m_headerSize > size || m_headerSize < 16) {
+        m_error = "Invalid header size";
+        return false;
+    }
+    if (m_headerSize < sizeof(VTFHeader)) {
+        memset(reinterpret_cast<uint8_t*>(&m_header) + m_headerSize, 0, sizeof(VTFHeader) - m_headerSize);
+    }
+    
+    size_t lowResSize = 0;
+    if (m_header.lowResImageFormat != static_cast<uint32_t>(IMAGE_FORMAT_NONE) &&
+        m_header.lowResImageWidth > 0 && m_header.lowResImageHeight > 0) {
+        lowResSize = CalculateImageSize(m_header.lowResImageWidth, m_header.lowResImageHeight,
+                                        static_cast<VTFImageFormat>(m_header.lowResImageFormat));
+    }
+    size_t highResSize = CalculateHighResSize(m_header);
+    
+    if (!HasResources()) {
+        // Header, thumbnail and image data follow each other
+        if (m_headerSize + lowResSize + highResSize > size) {
+            m_error = "File truncated - not enough image data";
+            return false;
+        }
+        const uint8_t* lowRes = data + m_headerSize;
+        m_lowRes.assign(lowRes, lowRes + lowResSize);
+        m_highRes.assign(lowRes + lowResSize, lowRes + lowResSize + highResSize);
+        return true;
+    }
+    
+    // Resource dictionary follows the 80-byte header
+    uint32_t count = m_header.numResources;
+    if (sizeof(VTFHeader) + static_cast<size_t>(count) * 8 > m_headerSize) {
+        m_error = "Invalid resource count";
+        return false;
+    }
+    
+    bool foundHighRes = false;
+    for (uint32_t i = 0; i < count; i++) {
+        const uint8_t* entry = data + sizeof(VTFHeader) + i * 8;
+        Resource resource;
+        memcpy(resource.tag, entry, 3);
+        resource.flags = entry[3];
+        memcpy(&resource.value, entry + 4, 4);
+        
+        if (!(resource.flags & kResourceNoData)) {
+            size_t offset = resource.value;
+            if (resource.Tag() == kResourceLowRes) {
+                if (offset + lowResSize > size) {
+                    m_error = "File truncated - not enough thumbnail data";
+                    return false;
+                }
+                m_lowRes.assign(data + offset, data + offset + lowResSize);
+            } else if (resource.Tag() == kResourceHighRes) {
+                if (offset + highResSize > size) {
+                    m_error = "File truncated - not enough image data";
+                    return false;
+                }
+                m_highRes.assign(data + offset, data + offset + highResSize);
+                foundHighRes = true;
+            } else {
+                uint32_t chunkSize = 0;
+                if (offset + 4 <= size) memcpy(&chunkSize, data + offset, 4);
+                if (offset + 4 + static_cast<size_t>(chunkSize) > size) {
+                    m_error = "File truncated - not enough resource data";
+                    return false;
+                }
+                resource.chunk.assign(data + offset, data + offset + 4 + chunkSize);
+            }
+        }
+        m_resources.push_back(std::move(resource));
+    }
+    
+    if (!foundHighRes) {
+        m_error = "No image data resource";
+        return false;
+    }
+    return true;
+}
+
+inline void VTFContainer::Serialize(VTFByteVector& output) const {
+    VTFHeader header = m_header;
+    output.clear();
+    
+    if (!HasResources()) {
+        size_t headerSize = m_headerSize;
+        output.resize(headerSize + m_lowRes.size() + m_highRes.size());
+        memcpy(output.data(), &header, headerSize < sizeof(VTFHeader) ? headerSize : sizeof(VTFHeader));
+        if (headerSize > sizeof(VTFHeader)) {
+            memset(output.data() + sizeof(VTFHeader), 0, headerSize - sizeof(VTFHeader));
+        }
+        if (!m_lowRes.empty()) memcpy(output.data() + headerSize, m_lowRes.data(), m_lowRes.size());
+        memcpy(output.data() + headerSize + m_lowRes.size(), m_highRes.data(), m_highRes.size());
+        return;
+    }
+    
+    // Data follows the dictionary in entry order
+    size_t headerSize = sizeof(VTFHeader) + m_resources.size() * 8;
+    header.headerSize = static_cast<uint32_t>(headerSize);
+    header.numResources = static_cast<uint32_t>(m_resources.size());
+    
+    size_t total = headerSize;
+    for (const Resource& resource : m_resources) {
+        if (resource.flags & kResourceNoData) continue;
+        if (resource.Tag() == kResourceLowRes) total += m_lowRes.size();
+        else if (resource.Tag() == kResourceHighRes) total += m_highRes.size();
+        else total += resource.chunk.size();
+    }
+    output.resize(total);
+    memcpy(output.data(), &header, sizeof(VTFHeader));
+    
+    size_t offset = headerSize;
+    for (size_t i = 0; i < m_resources.size(); i++) {
+        const Resource& resource = m_resources[i];
+        uint8_t* entry = output.data() + sizeof(VTFHeader) + i * 8;
+        memcpy(entry, resource.tag, 3);
+        entry[3] = resource.flags;
+        
+        if (resource.flags & kResourceNoData) {
+            memcpy(entry + 4, &resource.value, 4);
+            continue;
+        }
+        
+        const VTFByteVector& data = (resource.Tag() == kResourceLowRes) ? m_lowRes
+                                  : (resource.Tag() == kResourceHighRes) ? m_highRes
+                                  : resource.chunk;
+        uint32_t dataOffset = static_cast<uint32_t>(offset);
+        memcpy(entry + 4, &dataOffset, 4);
+        if (!data.empty()) memcpy(output.data() + offset, data.data(), data.size());
+        offset += data.size();
+    }
+}
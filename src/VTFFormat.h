@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
 
 // VTF File Format Definitions
@@ -40,6 +41,8 @@ struct VTFHeader {
 
 // VTF Image Formats
 enum VTFImageFormat {
+    IMAGE_FORMAT_AUTO_LOSSLESS = -3, // Writer only: I8, IA88, RGB888 or RGBA8888 by content
+    IMAGE_FORMAT_AUTO = -2,         // Writer only: DXT1, DXT1_ONEBITALPHA or DXT5 by alpha
     IMAGE_FORMAT_NONE = -1,
     IMAGE_FORMAT_RGBA8888 = 0,
     IMAGE_FORMAT_ABGR8888,
@@ -99,77 +102,126 @@ enum VTFFlags {
     TEXTUREFLAGS_BORDER             = 0x20000000,
 };
 
-// Get bytes per pixel for a format
-inline int GetBytesPerPixel(VTFImageFormat format) {
-    switch (format) {
-        case IMAGE_FORMAT_RGBA8888:
-        case IMAGE_FORMAT_ABGR8888:
-        case IMAGE_FORMAT_ARGB8888:
-        case IMAGE_FORMAT_BGRA8888:
-        case IMAGE_FORMAT_BGRX8888:
-        case IMAGE_FORMAT_UVWQ8888:
-        case IMAGE_FORMAT_UVLX8888:
-            return 4;
-        case IMAGE_FORMAT_RGB888:
-        case IMAGE_FORMAT_BGR888:
-        case IMAGE_FORMAT_RGB888_BLUESCREEN:
-        case IMAGE_FORMAT_BGR888_BLUESCREEN:
-            return 3;
-        case IMAGE_FORMAT_RGB565:
-        case IMAGE_FORMAT_BGR565:
-        case IMAGE_FORMAT_BGRX5551:
-        case IMAGE_FORMAT_BGRA5551:
-        case IMAGE_FORMAT_BGRA4444:
-        case IMAGE_FORMAT_IA88:
-        case IMAGE_FORMAT_UV88:
-            return 2;
-        case IMAGE_FORMAT_I8:
-        case IMAGE_FORMAT_P8:
-        case IMAGE_FORMAT_A8:
-            return 1;
-        case IMAGE_FORMAT_RGBA16161616F:
-        case IMAGE_FORMAT_RGBA16161616:
-            return 8;
-        default:
-            return 0; // Compressed formats handled separately
-    }
+// Static description of a VTF image format. Uncompressed formats are
+// treated as 1x1 blocks, so all size math is the same block arithmetic.
+struct VTFFormatTraits {
+    uint8_t     blockWidth;         // Pixels per block horizontally
+    uint8_t     blockHeight;        // Pixels per block vertically
+    uint8_t     bytesPerBlock;      // Bytes per block (per pixel if uncompressed)
+    uint8_t     alphaBits;          // Alpha precision, 0 for none
+    bool        compressed;         // Block-compressed (DXTn)
+    bool        srgb;               // Color is gamma-encoded by convention
+    const char* channels;           // Channel order in memory, e.g. "BGRA"
+};
+
+// Indexed by VTFImageFormat
+constexpr VTFFormatTraits kFormatTraits[IMAGE_FORMAT_COUNT] = {
+    { 1, 1,  4, 8, false, true,  "RGBA" },  // RGBA8888
+    { 1, 1,  4, 8, false, true,  "ABGR" },  // ABGR8888
+    { 1, 1,  3, 0, false, true,  "RGB"  },  // RGB888
+    { 1, 1,  3, 0, false, true,  "BGR"  },  // BGR888
+    { 1, 1,  2, 0, false, true,  "RGB"  },  // RGB565
+    { 1, 1,  1, 0, false, true,  "L"    },  // I8
+    { 1, 1,  2, 8, false, true,  "LA"   },  // IA88
+    { 1, 1,  1, 0, false, true,  "P"    },  // P8
+    { 1, 1,  1, 8, false, false, "A"    },  // A8
+    { 1, 1,  3, 0, false, true,  "RGB"  },  // RGB888_BLUESCREEN
+    { 1, 1,  3, 0, false, true,  "BGR"  },  // BGR888_BLUESCREEN
+    { 1, 1,  4, 8, false, true,  "ARGB" },  // ARGB8888
+    { 1, 1,  4, 8, false, true,  "BGRA" },  // BGRA8888
+    { 4, 4,  8, 0, true,  true,  "RGB"  },  // DXT1
+    { 4, 4, 16, 4, true,  true,  "RGBA" },  // DXT3
+    { 4, 4, 16, 8, true,  true,  "RGBA" },  // DXT5
+    { 1, 1,  4, 0, false, true,  "BGRX" },  // BGRX8888
+    { 1, 1,  2, 0, false, true,  "BGR"  },  // BGR565
+    { 1, 1,  2, 0, false, true,  "BGRX" },  // BGRX5551
+    { 1, 1,  2, 4, false, true,  "BGRA" },  // BGRA4444
+    { 4, 4,  8, 1, true,  true,  "RGBA" },  // DXT1_ONEBITALPHA
+    { 1, 1,  2, 1, false, true,  "BGRA" },  // BGRA5551
+    { 1, 1,  2, 0, false, false, "UV"   },  // UV88
+    { 1, 1,  4, 0, false, false, "UVWQ" },  // UVWQ8888
+    { 1, 1,  8, 16, false, false, "RGBA" }, // RGBA16161616F
+    { 1, 1,  8, 16, false, false, "RGBA" }, // RGBA16161616
+    { 1, 1,  4, 0, false, false, "UVLX" },  // UVLX8888
+};
+
+static_assert(kFormatTraits[IMAGE_FORMAT_UVLX8888].bytesPerBlock == 4, "kFormatTraits is out of step with VTFImageFormat");
+
+// Traits for unknown formats: no storage
+constexpr VTFFormatTraits kUnknownFormatTraits = { 1, 1, 0, 0, false, false, "" };
+
+// Usable in constant expressions, e.g. GetFormatTraits(Format).bytesPerBlock
+// inside a template specialised on the format
+constexpr const VTFFormatTraits& GetFormatTraits(VTFImageFormat format) {
+    return (format >= 0 && format < IMAGE_FORMAT_COUNT) ? kFormatTraits[format] : kUnknownFormatTraits;
+}
+
+// Get bytes per pixel for a format (0 for block-compressed formats)
+constexpr int GetBytesPerPixel(VTFImageFormat format) {
+    return GetFormatTraits(format).compressed ? 0 : GetFormatTraits(format).bytesPerBlock;
 }
 
-// Calculate image size for compressed formats
-inline size_t CalculateImageSize(int width, int height, VTFImageFormat format) {
+// Size of one image in the given format
+constexpr size_t CalculateImageSize(int width, int height, VTFImageFormat format) {
+    const VTFFormatTraits& traits = GetFormatTraits(format);
     if (width < 1) width = 1;
     if (height < 1) height = 1;
     
-    switch (format) {
-        case IMAGE_FORMAT_DXT1:
-        case IMAGE_FORMAT_DXT1_ONEBITALPHA:
-            return ((width + 3) / 4) * ((height + 3) / 4) * 8;
-        case IMAGE_FORMAT_DXT3:
-        case IMAGE_FORMAT_DXT5:
-            return ((width + 3) / 4) * ((height + 3) / 4) * 16;
-        default:
-            return width * height * GetBytesPerPixel(format);
-    }
+    return static_cast<size_t>((width + traits.blockWidth - 1) / traits.blockWidth) *
+           ((height + traits.blockHeight - 1) / traits.blockHeight) * traits.bytesPerBlock;
 }
 
 // Check if format has alpha
-inline bool FormatHasAlpha(VTFImageFormat format) {
-    switch (format) {
-        case IMAGE_FORMAT_RGBA8888:
-        case IMAGE_FORMAT_ABGR8888:
-        case IMAGE_FORMAT_ARGB8888:
-        case IMAGE_FORMAT_BGRA8888:
-        case IMAGE_FORMAT_BGRA5551:
-        case IMAGE_FORMAT_BGRA4444:
-        case IMAGE_FORMAT_DXT1_ONEBITALPHA:
-        case IMAGE_FORMAT_DXT3:
-        case IMAGE_FORMAT_DXT5:
-        case IMAGE_FORMAT_A8:
-        case IMAGE_FORMAT_IA88:
-        case IMAGE_FORMAT_RGBA16161616F:
-        case IMAGE_FORMAT_RGBA16161616:
-            return true;
-        default:
-            return false;
+constexpr bool FormatHasAlpha(VTFImageFormat format) {
+    return GetFormatTraits(format).alphaBits > 0;
+}
+
+// Alpha flag a file in this format carries (0 for formats without alpha)
+constexpr uint32_t GetFormatAlphaFlags(VTFImageFormat format) {
+    return GetFormatTraits(format).alphaBits == 0 ? 0u :
+           GetFormatTraits(format).alphaBits == 1 ? static_cast<uint32_t>(TEXTUREFLAGS_ONEBITALPHA) :
+                                                    static_cast<uint32_t>(TEXTUREFLAGS_EIGHTBITALPHA);
+}
+
+// How an image uses its alpha channel
+enum VTFAlphaClass {
+    ALPHA_CLASS_OPAQUE = 0,         // Every pixel is 255
+    ALPHA_CLASS_ONEBIT,             // Only 0 and 255
+    ALPHA_CLASS_EIGHTBIT,           // Intermediate values as well
+};
+
+// Number of faces stored per frame. Cube maps before 7.5 carry an extra
+// spheremap face unless firstFrame is 0xFFFF.
+inline int GetFaceCount(const VTFHeader& header) {
+    if (!(header.flags & TEXTUREFLAGS_ENVMAP)) return 1;
+    if (header.version[1] < 5 && header.firstFrame != 0xFFFF) return 7;
+    return 6;
+}
+
+// Depth of the largest mipmap (the field only exists from 7.2 on)
+inline int GetDepth(const VTFHeader& header) {
+    if (header.version[1] < 2 || header.depth < 1) return 1;
+    return header.depth;
+}
+
+// Size of one mipmap level across all frames, faces and depth slices
+inline size_t CalculateMipSize(const VTFHeader& header, int mip) {
+    int mipWidth = header.width >> mip;
+    int mipHeight = header.height >> mip;
+    int mipDepth = GetDepth(header) >> mip;
+    if (mipDepth < 1) mipDepth = 1;
+    
+    int frames = header.frames > 0 ? header.frames : 1;
+    size_t sliceSize = CalculateImageSize(mipWidth, mipHeight, static_cast<VTFImageFormat>(header.highResImageFormat));
+    return sliceSize * mipDepth * GetFaceCount(header) * frames;
+}
+
+// Size of the high-res image data (all mipmaps, frames, faces and slices)
+inline size_t CalculateHighResSize(const VTFHeader& header) {
+    int mipmapCount = header.mipmapCount > 0 ? header.mipmapCount : 1;
+    size_t size = 0;
+    for (int mip = 0; mip < mipmapCount; mip++) {
+        size += CalculateMipSize(header, mip);
     }
+    return size;
 }
@@ -35,6 +35,8 @@
 #include "PITerminology.h"
 #include "PIActions.h"
 
+#include "VTFTerminology.h"
+
 //-------------------------------------------------------------------------------
 //	PiPL resource
 //-------------------------------------------------------------------------------
@@ -57,6 +59,12 @@ resource 'PiPL' (16000, plugInName " PiPL", purgeable)
 		FilteredExtensions { { 'VTF ' } },
 
 		// Capabilities (must specify one from each pair, in order)
+		// Save options are recorded in actions and can be scripted
+		HasTerminology { plugInClassID,
+		                 plugInEventID,
+		                 vtfTerminologyID,
+		                 vtfUniqueID },
+
 		FormatFlags { fmtDoesNotSaveImageResources,
 		              fmtCanRead,
 		              fmtCanWrite,
@@ -67,7 +75,7 @@ resource 'PiPL' (16000, plugInName " PiPL", purgeable)
 		// Supported color modes
 		SupportedModes
 		{
-			noBitmap, noGrayScale,
+			noBitmap, doesSupportGrayScale,
 			noIndexedColor, doesSupportRGBColor,
 			noCMYKColor, noHSLColor,
 			noHSBColor, noMultichannel,
@@ -82,7 +90,84 @@ resource 'PiPL' (16000, plugInName " PiPL", purgeable)
 		FormatMaxSize { { 16384, 16384 } },
 
 		// Max channels per mode (bitmap, gray, indexed, RGB, CMYK, HSL, HSB, multi, duo, LAB, gray16, RGB48)
-		FormatMaxChannels { { 0, 0, 0, 4, 0, 0, 0, 0, 0, 0, 0, 0 } }
+		FormatMaxChannels { { 0, 2, 0, 4, 0, 0, 0, 0, 0, 0, 0, 0 } }
+	}
+};
+
+//-------------------------------------------------------------------------------
+//	Dictionary (scripting) resource
+//-------------------------------------------------------------------------------
+
+resource 'aete' (vtfTerminologyID, plugInName " dictionary", purgeable)
+{
+	1, 0, english, roman,						/* aete version and language specifiers */
+	{
+		vendorName,								/* vendor suite name */
+		plugInAETEComment,						/* optional description */
+		plugInSuiteID,							/* suite ID */
+		1,										/* suite code, must be 1 */
+		1,										/* suite level, must be 1 */
+		{},										/* structure for filters */
+		{										/* non-filter plug-in class here */
+			vendorName " vtfFormat",			/* unique class name */
+			plugInClassID,						/* class ID, must be unique or Suite ID */
+			plugInAETEComment,					/* optional description */
+			{									/* define inheritance */
+				"<Inheritance>",				/* must be exactly this */
+				keyInherits,					/* must be keyInherits */
+				classFormat,					/* parent: Format, Import, Export */
+				"parent class format",			/* optional description */
+				flagsSingleProperty,			/* if properties, list below */
+
+				"Format",
+				keyVTFFormat,
+				typeVTFFormat,
+				"",
+				flagsEnumeratedProperty,
+
+				"Flags",
+				keyVTFFlags,
+				typeInteger,
+				"",
+				flagsSingleProperty,
+
+				"Mipmaps",
+				keyVTFMipmaps,
+				typeBoolean,
+				"",
+				flagsSingleProperty
+			},
+			{},									/* elements (not supported) */
+		},
+		{},										/* comparison ops (not supported) */
+		{										/* any enumerations */
+			typeVTFFormat,
+			{
+				"DXT1",
+				enumVTFDXT1,
+				"",
+
+				"DXT5",
+				enumVTFDXT5,
+				"",
+
+				"RGBA8888",
+				enumVTFRGBA8888,
+				"",
+
+				"BGRA8888",
+				enumVTFBGRA8888,
+				"",
+
+				"Auto",
+				enumVTFAuto,
+				"",
+
+				"Auto Lossless",
+				enumVTFAutoLossless,
+				""
+			}
+		}
 	}
 };
 
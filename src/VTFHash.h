@@ -0,0 +1,141 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+// XXH64 (64-bit xxHash by Yann Collet), used to recognise unchanged image
+// data and file payloads. Fast enough to run over every decoded image.
+class VTFHash {
+public:
+    explicit VTFHash(uint64_t seed = 0) { Reset(seed); }
+    
+    void Reset(uint64_t seed = 0);
+    void Update(const void* data, size_t size);
+    uint64_t Digest() const;
+    
+    // One-shot hash of a buffer
+    static uint64_t Compute(const void* data, size_t size, uint64_t seed = 0);
+
+private:
+    static const uint64_t kPrime1 = 11400714785074694791ULL;
+    static const uint64_t kPrime2 = 14029467366897019727ULL;
+    static const uint64_t kPrime3 = 1609587929392839161ULL;
+    static const uint64_t kPrime4 = 9650029242287828579ULL;
+    static const uint64_t kPrime5 = 2870177450012600261ULL;
+    
+    static uint64_t Rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+    static uint64_t Read64(const uint8_t* p) { uint64_t v; memcpy(&v, p, 8); return v; }
+    static uint32_t Read32(const uint8_t* p) { uint32_t v; memcpy(&v, p, 4); return v; }
+    static uint64_t Round(uint64_t acc, uint64_t input);
+    static uint64_t MergeRound(uint64_t acc, uint64_t val);
+    
+    uint64_t m_seed;
+    uint64_t m_acc[4];
+    uint64_t m_totalSize;
+    uint8_t m_buffer[32];
+    size_t m_bufferSize;
+};
+
+// Implementation
+inline uint64_t VTFHash::Round(uint64_t acc, uint64_t input) {
+    acc += input * kPrime2;
+    acc = Rotl(acc, 31);
+    return acc * kPrime1;
+}
+
+inline uint64_t VTFHash::MergeRound(uint64_t acc, uint64_t val) {
+    acc ^= Round(0, val);
+    return acc * kPrime1 + kPrime4;
+}
+
+inline void VTFHash::Reset(uint64_t seed) {
+    m_seed = seed;
+    m_acc[0] = seed + kPrime1 + kPrime2;
+    m_acc[1] = seed + kPrime2;
+    m_acc[2] = seed;
+    m_acc[3] = seed - kPrime1;
+    m_totalSize = 0;
+    m_bufferSize = 0;
+}
+
+inline void VTFHash::Update(const void* data, size_t size) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    const uint8_t* end = p + size;
+    m_totalSize += size;
+    
+    // Top up a partial stripe first
+    if (m_bufferSize + size < 32) {
+        if (size > 0) memcpy(m_buffer + m_bufferSize, p, size);
+        m_bufferSize += size;
+        return;
+    }
+    if (m_bufferSize > 0) {
+        size_t fill = 32 - m_bufferSize;
+        memcpy(m_buffer + m_bufferSize, p, fill);
+        for (int i = 0; i < 4; i++) {
+            m_acc[i] = Round(m_acc[i], Read64(m_buffer + i * 8));
+        }
+        p += fill;
+        m_bufferSize = 0;
+    }
+    
+    // Whole 32-byte stripes straight from the input
+    uint64_t v0 = m_acc[0], v1 = m_acc[1], v2 = m_acc[2], v3 = m_acc[3];
+    while (end - p >= 32) {
+        v0 = Round(v0, Read64(p));
+        v1 = Round(v1, Read64(p + 8));
+        v2 = Round(v2, Read64(p + 16));
+        v3 = Round(v3, Read64(p + 24));
+        p += 32;
+    }
+    m_acc[0] = v0; m_acc[1] = v1; m_acc[2] = v2; m_acc[3] = v3;
+    
+    m_bufferSize = static_cast<size_t>(end - p);
+    if (m_bufferSize > 0) memcpy(m_buffer, p, m_bufferSize);
+}
+
+inline uint64_t VTFHash::Digest() const {
+    uint64_t h;
+    if (m_totalSize >= 32) {
+        h = Rotl(m_acc[0], 1) + Rotl(m_acc[1], 7) + Rotl(m_acc[2], 12) + Rotl(m_acc[3], 18);
+        for (int i = 0; i < 4; i++) {
+            h = MergeRound(h, m_acc[i]);
+        }
+    } else {
+        h = m_seed + kPrime5;
+    }
+    h += m_totalSize;
+    
+    // Remaining tail bytes
+    const uint8_t* p = m_buffer;
+    const uint8_t* end = m_buffer + m_bufferSize;
+    while (end - p >= 8) {
+        h ^= Round(0, Read64(p));
+        h = Rotl(h, 27) * kPrime1 + kPrime4;
+        p += 8;
+    }
+    if (end - p >= 4) {
+        h ^= static_cast<uint64_t>(Read32(p)) * kPrime1;
+        h = Rotl(h, 23) * kPrime2 + kPrime3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= (*p) * kPrime5;
+        h = Rotl(h, 11) * kPrime1;
+        p++;
+    }
+    
+    // Avalanche
+    h ^= h >> 33;
+    h *= kPrime2;
+    h ^= h >> 29;
+    h *= kPrime3;
+    h ^= h >> 32;
+    return h;
+}
+
+inline uint64_t VTFHash::Compute(const void* data, size_t size, uint64_t seed) {
+    VTFHash hash(seed);
+    hash.Update(data, size);
+    return hash.Digest();
+}
@@ -1,11 +1,24 @@
 #pragma once
 
+#include <atomic>
+#include <cmath>
 #include <cstdint>
+#include <mutex>
 #include <vector>
 #include <string>
 #include <fstream>
 #include "VTFFormat.h"
+#include "VTFAllocator.h"
 #include "DXTDecompress.h"
+#include "VTFPixelConvert.h"
+#include "VTFThreadPool.h"
+
+// Statistics of an image, from VTFLoader::Analyze()
+struct VTFImageStats {
+    float averageColor[4];          // Mean R, G, B, A in 0-1, as stored
+    float reflectivity[3];          // Mean linear-light R, G, B, as the header stores it
+    VTFAlphaClass alphaClass;
+};
 
 class VTFLoader {
 public:
@@ -17,6 +30,22 @@ public:
     bool Load(const wchar_t* filename);
     bool LoadFromMemory(const uint8_t* data, size_t size);
     
+    // Streaming load: the caller owns a buffer sized for the whole file and
+    // fills it front to back. BeginStream() needs the header to be resident,
+    // DecodeResident() decodes every mip 0 row whose bytes have arrived, and
+    // FinishStream() fails if the image was never completely decoded.
+    // DecodeResident() may run on another thread than the one filling data.
+    bool BeginStream(const uint8_t* data, size_t size);
+    void DecodeResident(size_t residentBytes);
+    bool FinishStream();
+    
+    // Computes statistics of mip 0, frame 0 of a file in memory without
+    // decoding it: DXT blocks through their palettes and index counts,
+    // other formats in one pass that builds channel histograms. Reads the
+    // header like a load, so the image properties below describe the file
+    // afterwards, but GetRGBAData() holds no image until the next load.
+    bool Analyze(const uint8_t* data, size_t size, VTFImageStats& stats);
+    
     // Get image properties
     int GetWidth() const { return m_width; }
     int GetHeight() const { return m_height; }
@@ -24,18 +53,38 @@ public:
     int GetMipmapCount() const { return m_mipmapCount; }
     bool HasAlpha() const { return m_hasAlpha; }
     VTFImageFormat GetFormat() const { return m_format; }
-    
-    // Get decoded RGBA data (always returns RGBA8888)
+    uint32_t GetFlags() const { return m_flags; }
+    float GetReflectivity(int channel) const { return m_reflectivity[channel]; }
+    
+    // Channels of the decoded pixels: 4 = RGBA (the default), 3 = RGB,
+    // 2 = gray and alpha, 1 = gray. 0 picks gray for I8 and IA88 files and
+    // RGB otherwise, plus alpha when the format has it and some pixel isn't
+    // opaque. Pixels are decoded straight into that layout; only a stream
+    // of opaque alpha is repacked without it by FinishStream(). Applies
+    // from the next load.
+    void SetOutputChannels(int channels) { m_outputChannels = channels; }
+    int GetChannelCount() const { return m_channels; }
+    
+    // Get decoded pixel data, interleaved with GetChannelCount() channels
     // Returns pointer to internal buffer, valid until next Load() or destruction
     const uint8_t* GetRGBAData(int frame = 0, int mipmap = 0);
     
+    // Frees internal buffers larger than maxBytes. Smaller ones are kept
+    // so a reused loader decodes the next file without reallocating.
+    void Trim(size_t maxBytes);
+    
     // Get last error message
     const std::string& GetError() const { return m_error; }
     
 private:
     bool ParseHeader(const uint8_t* data, size_t size);
-    bool DecodeImage(const uint8_t* srcData, size_t srcSize);
-    void ConvertToRGBA(const uint8_t* src, uint8_t* dst, int width, int height, VTFImageFormat format);
+    bool FindImageOffset(const uint8_t* srcData, size_t srcSize);
+    bool StartDecode(const uint8_t* data, size_t size, bool resident);
+    bool LocateImage(const uint8_t* srcData, size_t srcSize, bool resident);
+    bool RowsOpaque(const uint8_t* src, int width, int height) const;
+    bool ImageOpaque(const uint8_t* src) const;
+    void ConvertRGBA(const uint8_t* rgba, uint8_t* dst, size_t count) const;
+    void DecodeRows(const uint8_t* src, uint8_t* dst, int width, int height);
     
     // Image properties
     int m_width = 0;
@@ -44,16 +93,34 @@ private:
     int m_mipmapCount = 0;
     bool m_hasAlpha = false;
     VTFImageFormat m_format = IMAGE_FORMAT_NONE;
+    uint32_t m_flags = 0;
+    float m_reflectivity[3] = {0.5f, 0.5f, 0.5f};
     
     // Version info
     int m_versionMajor = 0;
     int m_versionMinor = 0;
     
     // Raw file data
-    std::vector<uint8_t> m_fileData;
-    
-    // Decoded RGBA data
-    std::vector<uint8_t> m_rgbaData;
+    VTFByteVector m_fileData;
+    
+    // Decoded pixel data
+    VTFByteVector m_rgbaData;
+    int m_outputChannels = 4;
+    int m_channels = 4;
+    
+    // Streaming state: location of mip 0 / frame 0 and decode progress,
+    // counted in row units (block rows for DXT, pixel rows otherwise)
+    const uint8_t* m_streamData = nullptr;
+    size_t m_imageOffset = 0;
+    size_t m_rowUnitBytes = 0;
+    int m_rowUnitPixels = 1;
+    int m_rowUnitCount = 0;
+    int m_rowUnitsDecoded = 0;
+    
+    // Automatic channels of a stream: the alpha of each band is checked
+    // as it decodes, and whether any pixel was transparent
+    bool m_scanAlpha = false;
+    std::atomic<bool> m_sawTransparency{false};
     
     // Error message
     std::string m_error;
@@ -63,6 +130,12 @@ private:
 inline VTFLoader::VTFLoader() {}
 inline VTFLoader::~VTFLoader() {}
 
+inline void VTFLoader::Trim(size_t maxBytes) {
+    if (m_fileData.capacity() > maxBytes) VTFByteVector().swap(m_fileData);
+    if (m_rgbaData.capacity() > maxBytes) VTFByteVector().swap(m_rgbaData);
+    m_streamData = nullptr;
+}
+
 inline bool VTFLoader::Load(const char* filename) {
     std::ifstream file(filename, std::ios::binary | std::ios::ate);
     if (!file.is_open()) {
@@ -102,14 +175,103 @@ inline bool VTFLoader::Load(const wchar_t* filename) {
 }
 
 inline bool VTFLoader::LoadFromMemory(const uint8_t* data, size_t size) {
+    if (!StartDecode(data, size, true)) {
+        return false;
+    }
+    
+    DecodeResident(size);
+    return FinishStream();
+}
+
+inline bool VTFLoader::BeginStream(const uint8_t* data, size_t size) {
+    return StartDecode(data, size, false);
+}
+
+// Starts a decode; 'resident' says the whole file is already in memory
+inline bool VTFLoader::StartDecode(const uint8_t* data, size_t size, bool resident) {
+    m_streamData = nullptr;
+    m_rowUnitsDecoded = 0;
+    
     if (!ParseHeader(data, size)) {
         return false;
     }
     
-    return DecodeImage(data, size);
+    if (!LocateImage(data, size, resident)) {
+        return false;
+    }
+    
+    m_streamData = data;
+    return true;
+}
+
+inline void VTFLoader::DecodeResident(size_t residentBytes) {
+    if (!m_streamData || residentBytes <= m_imageOffset) return;
+    
+    size_t available = (residentBytes - m_imageOffset) / m_rowUnitBytes;
+    int rowUnitsReady = (available < static_cast<size_t>(m_rowUnitCount))
+                      ? static_cast<int>(available) : m_rowUnitCount;
+    if (rowUnitsReady <= m_rowUnitsDecoded) return;
+    
+    // Decode the newly resident band of rows
+    int firstRow = m_rowUnitsDecoded * m_rowUnitPixels;
+    int lastRow = rowUnitsReady * m_rowUnitPixels;
+    if (lastRow > m_height) lastRow = m_height;
+    
+    // Rows are independent, so the band is split across the worker pool
+    const uint8_t* src = m_streamData + m_imageOffset + static_cast<size_t>(m_rowUnitsDecoded) * m_rowUnitBytes;
+    uint8_t* dst = m_rgbaData.data() + static_cast<size_t>(firstRow) * m_width * m_channels;
+    int units = rowUnitsReady - m_rowUnitsDecoded;
+    int grain = (65536 + m_width * m_rowUnitPixels - 1) / (m_width * m_rowUnitPixels);
+    
+    VTFThreadPool::ParallelFor(units, grain, [&](int begin, int end) {
+        int rowBegin = begin * m_rowUnitPixels;
+        int rowEnd = end * m_rowUnitPixels;
+        if (rowEnd > lastRow - firstRow) rowEnd = lastRow - firstRow;
+        
+        const uint8_t* unitSrc = src + static_cast<size_t>(begin) * m_rowUnitBytes;
+        if (m_scanAlpha && !m_sawTransparency.load(std::memory_order_relaxed) &&
+            !RowsOpaque(unitSrc, m_width, rowEnd - rowBegin)) {
+            m_sawTransparency.store(true, std::memory_order_relaxed);
+        }
+        
+        DecodeRows(src + static_cast<size_t>(begin) * m_rowUnitBytes,
+                   dst + static_cast<size_t>(rowBegin) * m_width * m_channels,
+                   m_width, rowEnd - rowBegin);
+    });
+    
+    m_rowUnitsDecoded = rowUnitsReady;
+}
+
+inline bool VTFLoader::FinishStream() {
+    m_streamData = nullptr;
+    
+    if (m_rowUnitsDecoded < m_rowUnitCount) {
+        m_error = "File truncated - not enough image data";
+        return false;
+    }
+    
+    if (m_scanAlpha && !m_sawTransparency.load()) {
+        // Every pixel was opaque: drop the alpha in place. Pixel i moves
+        // to a lower offset and is read before it is written, so no pixel
+        // is overwritten before it has moved.
+        size_t pixelCount = static_cast<size_t>(m_width) * m_height;
+        if (m_channels == 4) {
+            VTFConvertPixels<VTFLayout::RGBA8888, VTFLayout::RGB888>(m_rgbaData.data(), m_rgbaData.data(), pixelCount);
+        } else {
+            VTFConvertPixels<VTFLayout::IA88, VTFLayout::I8>(m_rgbaData.data(), m_rgbaData.data(), pixelCount);
+        }
+        m_channels--;
+        m_rgbaData.resize(pixelCount * m_channels);
+    }
+    m_scanAlpha = false;
+    
+    return true;
 }
 
 inline bool VTFLoader::ParseHeader(const uint8_t* data, size_t size) {
+    // A reused loader mustn't report the last file's error
+    m_error.clear();
+    
     if (size < sizeof(VTFHeader)) {
         m_error = "File too small for VTF header";
         return false;
@@ -140,6 +302,10 @@ inline bool VTFLoader::ParseHeader(const uint8_t* data, size_t size) {
     m_mipmapCount = header->mipmapCount;
     m_format = static_cast<VTFImageFormat>(header->highResImageFormat);
     m_hasAlpha = FormatHasAlpha(m_format);
+    m_flags = header->flags;
+    for (int c = 0; c < 3; c++) {
+        m_reflectivity[c] = header->reflectivity[c];
+    }
     
     if (m_frameCount < 1) m_frameCount = 1;
     if (m_mipmapCount < 1) m_mipmapCount = 1;
@@ -147,9 +313,15 @@ inline bool VTFLoader::ParseHeader(const uint8_t* data, size_t size) {
     return true;
 }
 
-inline bool VTFLoader::DecodeImage(const uint8_t* srcData, size_t srcSize) {
+// Finds mip 0, frame 0 and checks the file holds all image data
+inline bool VTFLoader::FindImageOffset(const uint8_t* srcData, size_t srcSize) {
     const VTFHeader* header = reinterpret_cast<const VTFHeader*>(srcData);
-    
+
+    if (m_width < 1 || m_height < 1) {
+        m_error = "Invalid image dimensions";
+        return false;
+    }
+
     // Calculate data offset
     size_t dataOffset = header->headerSize;
     
@@ -160,162 +332,263 @@ inline bool VTFLoader::DecodeImage(const uint8_t* srcData, size_t srcSize) {
                                          static_cast<VTFImageFormat>(header->lowResImageFormat));
     }
     
-    // Calculate size of high-res image data (all mipmaps, all frames)
-    size_t imageDataSize = 0;
-    int mipWidth = m_width;
-    int mipHeight = m_height;
-    for (int mip = m_mipmapCount - 1; mip >= 0; mip--) {
-        imageDataSize += CalculateImageSize(mipWidth, mipHeight, m_format) * m_frameCount;
-        mipWidth = (mipWidth > 1) ? mipWidth / 2 : 1;
-        mipHeight = (mipHeight > 1) ? mipHeight / 2 : 1;
-    }
+    // Calculate size of high-res image data (all mipmaps, frames, faces and slices)
+    size_t imageDataSize = CalculateHighResSize(*header);
     
     if (dataOffset + imageDataSize > srcSize) {
         m_error = "File truncated - not enough image data";
         return false;
     }
     
-    // Allocate output buffer (RGBA8888)
-    m_rgbaData.resize(m_width * m_height * 4);
-    
     // Find offset to mipmap 0, frame 0 (stored last in VTF files)
     // Mipmaps are stored smallest to largest
     size_t offset = dataOffset;
-    mipWidth = m_width;
-    mipHeight = m_height;
     for (int mip = m_mipmapCount - 1; mip > 0; mip--) {
-        mipWidth = (mipWidth > 1) ? mipWidth / 2 : 1;
-        mipHeight = (mipHeight > 1) ? mipHeight / 2 : 1;
-        offset += CalculateImageSize(mipWidth, mipHeight, m_format) * m_frameCount;
+        offset += CalculateMipSize(*header, mip);
     }
-    
-    // Decode the largest mipmap (mip 0)
-    const uint8_t* imageData = srcData + offset;
-    ConvertToRGBA(imageData, m_rgbaData.data(), m_width, m_height, m_format);
-    
+    m_imageOffset = offset;
     return true;
 }
 
-inline void VTFLoader::ConvertToRGBA(const uint8_t* src, uint8_t* dst, int width, int height, VTFImageFormat format) {
-    int pixelCount = width * height;
+inline bool VTFLoader::LocateImage(const uint8_t* srcData, size_t srcSize, bool resident) {
+    if (!FindImageOffset(srcData, srcSize)) {
+        return false;
+    }
     
-    switch (format) {
-        case IMAGE_FORMAT_RGBA8888:
-            // Already RGBA, just copy
-            memcpy(dst, src, pixelCount * 4);
-            break;
-            
-        case IMAGE_FORMAT_ABGR8888:
-            // ABGR -> RGBA
-            for (int i = 0; i < pixelCount; i++) {
-                dst[i*4 + 0] = src[i*4 + 3]; // R
-                dst[i*4 + 1] = src[i*4 + 2]; // G
-                dst[i*4 + 2] = src[i*4 + 1]; // B
-                dst[i*4 + 3] = src[i*4 + 0]; // A
-            }
-            break;
-            
-        case IMAGE_FORMAT_RGB888:
-            // RGB -> RGBA
-            for (int i = 0; i < pixelCount; i++) {
-                dst[i*4 + 0] = src[i*3 + 0];
-                dst[i*4 + 1] = src[i*3 + 1];
-                dst[i*4 + 2] = src[i*3 + 2];
-                dst[i*4 + 3] = 255;
-            }
-            break;
-            
-        case IMAGE_FORMAT_BGR888:
-            // BGR -> RGBA
-            for (int i = 0; i < pixelCount; i++) {
-                dst[i*4 + 0] = src[i*3 + 2]; // R
-                dst[i*4 + 1] = src[i*3 + 1]; // G
-                dst[i*4 + 2] = src[i*3 + 0]; // B
-                dst[i*4 + 3] = 255;          // A
-            }
-            break;
-            
-        case IMAGE_FORMAT_ARGB8888:
-            // ARGB -> RGBA
-            for (int i = 0; i < pixelCount; i++) {
-                dst[i*4 + 0] = src[i*4 + 1]; // R
-                dst[i*4 + 1] = src[i*4 + 2]; // G
-                dst[i*4 + 2] = src[i*4 + 3]; // B
-                dst[i*4 + 3] = src[i*4 + 0]; // A
-            }
-            break;
-            
-        case IMAGE_FORMAT_BGRA8888:
-            // BGRA -> RGBA
-            for (int i = 0; i < pixelCount; i++) {
-                dst[i*4 + 0] = src[i*4 + 2]; // R
-                dst[i*4 + 1] = src[i*4 + 1]; // G
-                dst[i*4 + 2] = src[i*4 + 0]; // B
-                dst[i*4 + 3] = src[i*4 + 3]; // A
-            }
-            break;
-            
-        case IMAGE_FORMAT_BGRX8888:
-            // BGRX -> RGBA (X = unused)
-            for (int i = 0; i < pixelCount; i++) {
-                dst[i*4 + 0] = src[i*4 + 2]; // R
-                dst[i*4 + 1] = src[i*4 + 1]; // G
-                dst[i*4 + 2] = src[i*4 + 0]; // B
-                dst[i*4 + 3] = 255;          // A
-            }
-            break;
-            
-        case IMAGE_FORMAT_DXT1:
-        case IMAGE_FORMAT_DXT1_ONEBITALPHA:
-        case IMAGE_FORMAT_DXT3:
-        case IMAGE_FORMAT_DXT5:
-            DXT::DecompressDXT(src, dst, width, height, static_cast<int>(format));
-            break;
-            
-        case IMAGE_FORMAT_I8:
-            // Grayscale -> RGBA
-            for (int i = 0; i < pixelCount; i++) {
-                dst[i*4 + 0] = src[i];
-                dst[i*4 + 1] = src[i];
-                dst[i*4 + 2] = src[i];
-                dst[i*4 + 3] = 255;
-            }
-            break;
-            
-        case IMAGE_FORMAT_IA88:
-            // Grayscale+Alpha -> RGBA
-            for (int i = 0; i < pixelCount; i++) {
-                dst[i*4 + 0] = src[i*2 + 0];
-                dst[i*4 + 1] = src[i*2 + 0];
-                dst[i*4 + 2] = src[i*2 + 0];
-                dst[i*4 + 3] = src[i*2 + 1];
-            }
-            break;
-            
-        case IMAGE_FORMAT_A8:
-            // Alpha only -> RGBA (white with alpha)
-            for (int i = 0; i < pixelCount; i++) {
-                dst[i*4 + 0] = 255;
-                dst[i*4 + 1] = 255;
-                dst[i*4 + 2] = 255;
-                dst[i*4 + 3] = src[i];
-            }
+    // Rows of mip 0 are decoded in whole units: one block row for DXT
+    // formats, one pixel row for everything else
+    m_rowUnitPixels = GetFormatTraits(m_format).blockHeight;
+    m_rowUnitCount = (m_height + m_rowUnitPixels - 1) / m_rowUnitPixels;
+    m_rowUnitBytes = CalculateImageSize(m_width, m_height, m_format) / m_rowUnitCount;
+    if (m_rowUnitBytes == 0) m_rowUnitBytes = 1;
+    m_rowUnitsDecoded = 0;
+    
+    // Automatic channels keep grayscale formats gray and leave out alpha
+    // that is opaque everywhere. A resident image is checked up front; a
+    // stream is checked band by band and repacked once it is complete.
+    int colorChannels = (m_format == IMAGE_FORMAT_I8 || m_format == IMAGE_FORMAT_IA88) ? 1 : 3;
+    m_channels = (m_outputChannels >= 1 && m_outputChannels <= 4) ? m_outputChannels
+                                                                   : colorChannels + (m_hasAlpha ? 1 : 0);
+    m_scanAlpha = false;
+    m_sawTransparency.store(false);
+    if (m_outputChannels == 0 && m_hasAlpha) {
+        if (resident) {
+            if (ImageOpaque(srcData + m_imageOffset)) m_channels = colorChannels;
+        } else {
+            m_scanAlpha = true;
+        }
+    }
+    
+    // Allocate output buffer
+    m_rgbaData.resize(static_cast<size_t>(m_width) * m_height * m_channels);
+    
+    // Unsupported formats still decode (to magenta) but leave a message
+    switch (m_format) {
+        case IMAGE_FORMAT_RGBA8888: case IMAGE_FORMAT_ABGR8888: case IMAGE_FORMAT_RGB888:
+        case IMAGE_FORMAT_BGR888: case IMAGE_FORMAT_ARGB8888: case IMAGE_FORMAT_BGRA8888:
+        case IMAGE_FORMAT_BGRX8888: case IMAGE_FORMAT_DXT1: case IMAGE_FORMAT_DXT1_ONEBITALPHA:
+        case IMAGE_FORMAT_DXT3: case IMAGE_FORMAT_DXT5: case IMAGE_FORMAT_I8:
+        case IMAGE_FORMAT_IA88: case IMAGE_FORMAT_A8:
             break;
-            
         default:
-            // Unsupported format - fill with magenta
-            m_error = "Unsupported image format: " + std::to_string(static_cast<int>(format));
-            for (int i = 0; i < pixelCount; i++) {
-                dst[i*4 + 0] = 255;
-                dst[i*4 + 1] = 0;
-                dst[i*4 + 2] = 255;
-                dst[i*4 + 3] = 255;
-            }
+            m_error = "Unsupported image format: " + std::to_string(static_cast<int>(m_format));
             break;
     }
+    
+    return true;
+}
+
+// Whether whole row units of mip 0 are opaque, checked without decoding:
+// DXT blocks through their stored alpha, other formats through their alpha
+// bytes. Formats the loader can't read count as transparent.
+inline bool VTFLoader::RowsOpaque(const uint8_t* src, int width, int height) const {
+    const VTFFormatTraits& traits = GetFormatTraits(m_format);
+    if (traits.compressed) {
+        size_t blocks = static_cast<size_t>((width + 3) / 4) * ((height + 3) / 4);
+        for (size_t i = 0; i < blocks; i++) {
+            if (!DXT::IsBlockOpaque(src + i * traits.bytesPerBlock, m_format)) return false;
+        }
+        return true;
+    }
+    
+    return VTFPixelsOpaqueInFormat(m_format, src, static_cast<size_t>(width) * height);
+}
+
+// RowsOpaque over all of mip 0, split across the worker pool
+inline bool VTFLoader::ImageOpaque(const uint8_t* src) const {
+    std::atomic<bool> transparent(false);
+    int grain = (262144 + m_width * m_rowUnitPixels - 1) / (m_width * m_rowUnitPixels);
+    
+    VTFThreadPool::ParallelFor(m_rowUnitCount, grain, [&](int begin, int end) {
+        if (transparent.load(std::memory_order_relaxed)) return;
+        
+        int rowBegin = begin * m_rowUnitPixels;
+        int rowEnd = end * m_rowUnitPixels;
+        if (rowEnd > m_height) rowEnd = m_height;
+        if (!RowsOpaque(src + static_cast<size_t>(begin) * m_rowUnitBytes, m_width, rowEnd - rowBegin)) {
+            transparent.store(true, std::memory_order_relaxed);
+        }
+    });
+    
+    return !transparent.load();
+}
+
+// Converts RGBA pixels to the output layout
+inline void VTFLoader::ConvertRGBA(const uint8_t* rgba, uint8_t* dst, size_t count) const {
+    switch (m_channels) {
+        case 1:  VTFConvertPixels<VTFLayout::RGBA8888, VTFLayout::I8>(rgba, dst, count); break;
+        case 2:  VTFConvertPixels<VTFLayout::RGBA8888, VTFLayout::IA88>(rgba, dst, count); break;
+        case 3:  VTFConvertPixels<VTFLayout::RGBA8888, VTFLayout::RGB888>(rgba, dst, count); break;
+        default: VTFConvertPixels<VTFLayout::RGBA8888, VTFLayout::RGBA8888>(rgba, dst, count); break;
+    }
+}
+
+// Decodes whole row units of mip 0 into the output layout
+inline void VTFLoader::DecodeRows(const uint8_t* src, uint8_t* dst, int width, int height) {
+    size_t pixelCount = static_cast<size_t>(width) * height;
+    
+    // Blocks are written straight into the output layout
+    if (GetFormatTraits(m_format).compressed) {
+        switch (m_channels) {
+            case 1:  DXT::DecompressDXT<VTFLayout::I8>(src, dst, width, height, m_format); break;
+            case 2:  DXT::DecompressDXT<VTFLayout::IA88>(src, dst, width, height, m_format); break;
+            case 3:  DXT::DecompressDXT<VTFLayout::RGB888>(src, dst, width, height, m_format); break;
+            default: DXT::DecompressDXT<VTFLayout::RGBA8888>(src, dst, width, height, m_format); break;
+        }
+        return;
+    }
+    
+    bool converted;
+    switch (m_channels) {
+        case 1:  converted = VTFConvertFromFormat<VTFLayout::I8>(m_format, src, dst, pixelCount); break;
+        case 2:  converted = VTFConvertFromFormat<VTFLayout::IA88>(m_format, src, dst, pixelCount); break;
+        case 3:  converted = VTFConvertFromFormat<VTFLayout::RGB888>(m_format, src, dst, pixelCount); break;
+        default: converted = VTFConvertFromFormat<VTFLayout::RGBA8888>(m_format, src, dst, pixelCount); break;
+    }
+    
+    if (!converted) {
+        // Unsupported format - fill with magenta (reported by LocateImage)
+        const uint8_t magenta[4] = {255, 0, 255, 255};
+        uint8_t pixel[4];
+        ConvertRGBA(magenta, pixel, 1);
+        for (size_t i = 0; i < pixelCount; i++) {
+            memcpy(dst + i * m_channels, pixel, m_channels);
+        }
+    }
 }
 
 inline const uint8_t* VTFLoader::GetRGBAData(int frame, int mipmap) {
     // TODO: Support multiple frames and mipmaps
     return m_rgbaData.data();
 }
+
+inline bool VTFLoader::Analyze(const uint8_t* data, size_t size, VTFImageStats& stats) {
+    m_streamData = nullptr;
+    m_rgbaData.clear();
+    if (!ParseHeader(data, size) || !FindImageOffset(data, size)) {
+        return false;
+    }
+    
+    // Linear light of each 8-bit value, with the 2.2 gamma vtex assumes
+    static const struct LinearTable {
+        float value[256];
+        LinearTable() {
+            for (int i = 0; i < 256; i++) value[i] = static_cast<float>(pow(i / 255.0, 2.2));
+        }
+    } linear;
+    
+    const uint8_t* image = data + m_imageOffset;
+    const VTFFormatTraits& traits = GetFormatTraits(m_format);
+    
+    // Totals over the image, merged from the worker chunks
+    std::mutex mutex;
+    double sum[4] = {};
+    double linearSum[3] = {};
+    double pixels = 0;
+    VTFAlphaClass alphaClass = ALPHA_CLASS_OPAQUE;
+    
+    if (traits.compressed) {
+        int blocksX = (m_width + 3) / 4;
+        int blocksY = (m_height + 3) / 4;
+        size_t blockBytes = traits.bytesPerBlock;
+        
+        VTFThreadPool::ParallelFor(blocksY, 64, [&](int begin, int end) {
+            uint64_t chunkSum[4] = {};
+            double chunkLinear[3] = {};
+            VTFAlphaClass chunkClass = ALPHA_CLASS_OPAQUE;
+            
+            for (int by = begin; by < end; by++) {
+                const uint8_t* block = image + static_cast<size_t>(by) * blocksX * blockBytes;
+                int rows = (m_height - by * 4 < 4) ? m_height - by * 4 : 4;
+                for (int bx = 0; bx < blocksX; bx++, block += blockBytes) {
+                    // Edge blocks count only their pixels inside the image
+                    int columns = (m_width - bx * 4 < 4) ? m_width - bx * 4 : 4;
+                    uint16_t mask = (rows == 4 && columns == 4) ? 0xFFFF : DXT::BlockPixelMask(columns, rows);
+                    
+                    const uint8_t* color = DXT::ColorBlock(block, m_format);
+                    uint16_t color0, color1;
+                    memcpy(&color0, color, 2);
+                    memcpy(&color1, color + 2, 2);
+                    
+                    uint8_t palette[4][4];
+                    int counts[4];
+                    DXT::BuildColorPalette(color0, color1, m_format == IMAGE_FORMAT_DXT1_ONEBITALPHA, palette);
+                    DXT::CountColorIndices(color, counts, mask);
+                    for (int i = 0; i < 4; i++) {
+                        for (int c = 0; c < 3; c++) {
+                            chunkSum[c] += counts[i] * palette[i][c];
+                            chunkLinear[c] += counts[i] * linear.value[palette[i][c]];
+                        }
+                    }
+                    
+                    VTFAlphaClass blockClass;
+                    chunkSum[3] += DXT::SumBlockAlpha(block, m_format, &blockClass, mask);
+                    if (blockClass > chunkClass) chunkClass = blockClass;
+                }
+            }
+            
+            std::lock_guard<std::mutex> lock(mutex);
+            for (int c = 0; c < 4; c++) sum[c] += static_cast<double>(chunkSum[c]);
+            for (int c = 0; c < 3; c++) linearSum[c] += chunkLinear[c];
+            if (chunkClass > alphaClass) alphaClass = chunkClass;
+        });
+        pixels = static_cast<double>(m_width) * m_height;
+    } else {
+        size_t rowBytes = static_cast<size_t>(m_width) * traits.bytesPerBlock;
+        std::vector<uint32_t> histogram(4 * 256);
+        bool converted = true;
+        
+        VTFThreadPool::ParallelFor(m_height, 256, [&](int begin, int end) {
+            uint32_t chunk[4][256] = {};
+            bool ok = VTFHistogramFromFormat(m_format, image + static_cast<size_t>(begin) * rowBytes,
+                                             static_cast<size_t>(end - begin) * m_width, chunk);
+            
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!ok) converted = false;
+            for (int c = 0; c < 4; c++) {
+                for (int v = 0; v < 256; v++) histogram[c * 256 + v] += chunk[c][v];
+            }
+        });
+        
+        if (!converted) {
+            m_error = "Unsupported image format: " + std::to_string(static_cast<int>(m_format));
+            return false;
+        }
+        
+        for (int v = 0; v < 256; v++) {
+            for (int c = 0; c < 4; c++) sum[c] += static_cast<double>(histogram[c * 256 + v]) * v;
+            for (int c = 0; c < 3; c++) linearSum[c] += histogram[c * 256 + v] * static_cast<double>(linear.value[v]);
+            
+            uint32_t alphaCount = histogram[3 * 256 + v];
+            if (alphaCount == 0 || v == 255) continue;
+            if (v == 0 && alphaClass < ALPHA_CLASS_ONEBIT) alphaClass = ALPHA_CLASS_ONEBIT;
+            if (v != 0) alphaClass = ALPHA_CLASS_EIGHTBIT;
+        }
+        pixels = static_cast<double>(m_width) * m_height;
+    }
+    
+    for (int c = 0; c < 4; c++) stats.averageColor[c] = static_cast<float>(sum[c] / (pixels * 255.0));
+    for (int c = 0; c < 3; c++) stats.reflectivity[c] = static_cast<float>(linearSum[c] / pixels);
+    stats.alphaClass = alphaClass;
+    return true;
+}
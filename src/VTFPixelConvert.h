@@ -0,0 +1,237 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include "VTFFormat.h"
+
+// Compile-time description of a pixel layout with one byte per channel:
+// the pixel size and the byte offset of each channel, -1 where it is
+// absent. L is a luminance channel standing in for R, G and B; X is a
+// padding byte, written as 255.
+template <int Size, int R, int G, int B, int A, int L = -1, int X = -1>
+struct VTFChannelLayout {
+    static const int kSize = Size;
+    static const int kR = R;
+    static const int kG = G;
+    static const int kB = B;
+    static const int kA = A;
+    static const int kL = L;
+    static const int kX = X;
+};
+
+namespace VTFLayout {
+
+// VTF storage layouts
+typedef VTFChannelLayout<4,  0,  1,  2,  3>         RGBA8888;
+typedef VTFChannelLayout<4,  3,  2,  1,  0>         ABGR8888;
+typedef VTFChannelLayout<3,  0,  1,  2, -1>         RGB888;
+typedef VTFChannelLayout<3,  2,  1,  0, -1>         BGR888;
+typedef VTFChannelLayout<4,  1,  2,  3,  0>         ARGB8888;
+typedef VTFChannelLayout<4,  2,  1,  0,  3>         BGRA8888;
+typedef VTFChannelLayout<4,  2,  1,  0, -1, -1, 3>  BGRX8888;
+typedef VTFChannelLayout<1, -1, -1, -1, -1,  0>     I8;
+typedef VTFChannelLayout<2, -1, -1, -1,  1,  0>     IA88;
+typedef VTFChannelLayout<1, -1, -1, -1,  0>         A8;
+
+// Photoshop's interleaved 8-bit RGB and grayscale documents, with and
+// without alpha
+typedef RGB888 HostRGB;
+typedef RGBA8888 HostRGBA;
+typedef I8 HostGray;
+typedef IA88 HostGrayAlpha;
+
+} // namespace VTFLayout
+
+// Reads channel 'Offset' of a pixel, or 'fallback' when the layout lacks it
+template <int Offset>
+inline uint8_t VTFReadChannel(const uint8_t* pixel, uint8_t fallback) {
+    return (Offset >= 0) ? pixel[Offset >= 0 ? Offset : 0] : fallback;
+}
+
+template <int Offset>
+inline void VTFWriteChannel(uint8_t* pixel, uint8_t value) {
+    if (Offset >= 0) pixel[Offset >= 0 ? Offset : 0] = value;
+}
+
+// Converts 'count' pixels from layout Src to layout Dst. Every offset is a
+// constant, so each pair compiles to a straight shuffle loop the compiler
+// can vectorize; identical layouts are a plain copy.
+template <class Src, class Dst>
+inline void VTFConvertPixels(const uint8_t* src, uint8_t* dst, size_t count) {
+    if (std::is_same<Src, Dst>::value) {
+        memcpy(dst, src, count * Src::kSize);
+        return;
+    }
+    
+    for (size_t i = 0; i < count; i++, src += Src::kSize, dst += Dst::kSize) {
+        // Luminance-only sources fill R, G and B; alpha-only ones are white
+        uint8_t l = VTFReadChannel<Src::kL>(src, 255);
+        uint8_t r = VTFReadChannel<Src::kR>(src, l);
+        uint8_t g = VTFReadChannel<Src::kG>(src, l);
+        uint8_t b = VTFReadChannel<Src::kB>(src, l);
+        uint8_t a = VTFReadChannel<Src::kA>(src, 255);
+        
+        VTFWriteChannel<Dst::kR>(dst, r);
+        VTFWriteChannel<Dst::kG>(dst, g);
+        VTFWriteChannel<Dst::kB>(dst, b);
+        VTFWriteChannel<Dst::kA>(dst, a);
+        VTFWriteChannel<Dst::kX>(dst, 255);
+        if (Dst::kL >= 0) {
+            // Rec. 601 luma when the source has color
+            uint8_t luma = (Src::kL >= 0) ? l : static_cast<uint8_t>((r * 77 + g * 150 + b * 29 + 128) >> 8);
+            VTFWriteChannel<Dst::kL>(dst, luma);
+        }
+    }
+}
+
+// Converts 'count' pixels stored in a VTF format to layout Dst. Returns
+// false for formats without a byte-per-channel layout (DXT, packed 16-bit
+// and float formats).
+template <class Dst>
+inline bool VTFConvertFromFormat(VTFImageFormat format, const uint8_t* src, uint8_t* dst, size_t count) {
+    switch (format) {
+        case IMAGE_FORMAT_RGBA8888: VTFConvertPixels<VTFLayout::RGBA8888, Dst>(src, dst, count); return true;
+        case IMAGE_FORMAT_ABGR8888: VTFConvertPixels<VTFLayout::ABGR8888, Dst>(src, dst, count); return true;
+        case IMAGE_FORMAT_RGB888:   VTFConvertPixels<VTFLayout::RGB888, Dst>(src, dst, count);   return true;
+        case IMAGE_FORMAT_BGR888:   VTFConvertPixels<VTFLayout::BGR888, Dst>(src, dst, count);   return true;
+        case IMAGE_FORMAT_ARGB8888: VTFConvertPixels<VTFLayout::ARGB8888, Dst>(src, dst, count); return true;
+        case IMAGE_FORMAT_BGRA8888: VTFConvertPixels<VTFLayout::BGRA8888, Dst>(src, dst, count); return true;
+        case IMAGE_FORMAT_BGRX8888: VTFConvertPixels<VTFLayout::BGRX8888, Dst>(src, dst, count); return true;
+        case IMAGE_FORMAT_I8:       VTFConvertPixels<VTFLayout::I8, Dst>(src, dst, count);       return true;
+        case IMAGE_FORMAT_IA88:     VTFConvertPixels<VTFLayout::IA88, Dst>(src, dst, count);     return true;
+        case IMAGE_FORMAT_A8:       VTFConvertPixels<VTFLayout::A8, Dst>(src, dst, count);       return true;
+        default:                    return false;
+    }
+}
+
+// Converts 'count' pixels in layout Src to a VTF format. Returns false for
+// formats without a byte-per-channel layout.
+template <class Src>
+inline bool VTFConvertToFormat(VTFImageFormat format, const uint8_t* src, uint8_t* dst, size_t count) {
+    switch (format) {
+        case IMAGE_FORMAT_RGBA8888: VTFConvertPixels<Src, VTFLayout::RGBA8888>(src, dst, count); return true;
+        case IMAGE_FORMAT_ABGR8888: VTFConvertPixels<Src, VTFLayout::ABGR8888>(src, dst, count); return true;
+        case IMAGE_FORMAT_RGB888:   VTFConvertPixels<Src, VTFLayout::RGB888>(src, dst, count);   return true;
+        case IMAGE_FORMAT_BGR888:   VTFConvertPixels<Src, VTFLayout::BGR888>(src, dst, count);   return true;
+        case IMAGE_FORMAT_ARGB8888: VTFConvertPixels<Src, VTFLayout::ARGB8888>(src, dst, count); return true;
+        case IMAGE_FORMAT_BGRA8888: VTFConvertPixels<Src, VTFLayout::BGRA8888>(src, dst, count); return true;
+        case IMAGE_FORMAT_BGRX8888: VTFConvertPixels<Src, VTFLayout::BGRX8888>(src, dst, count); return true;
+        case IMAGE_FORMAT_I8:       VTFConvertPixels<Src, VTFLayout::I8>(src, dst, count);       return true;
+        case IMAGE_FORMAT_IA88:     VTFConvertPixels<Src, VTFLayout::IA88>(src, dst, count);     return true;
+        case IMAGE_FORMAT_A8:       VTFConvertPixels<Src, VTFLayout::A8>(src, dst, count);       return true;
+        default:                    return false;
+    }
+}
+
+// Adds 'count' pixels in layout Src to per-channel histograms of R, G, B
+// and A, filling missing channels as VTFConvertPixels does. Means, linear
+// means and alpha use all follow from the histograms, so one pass over the
+// pixels is enough.
+template <class Src>
+inline void VTFHistogramPixels(const uint8_t* src, size_t count, uint32_t histogram[4][256]) {
+    for (size_t i = 0; i < count; i++, src += Src::kSize) {
+        uint8_t l = VTFReadChannel<Src::kL>(src, 255);
+        histogram[0][VTFReadChannel<Src::kR>(src, l)]++;
+        histogram[1][VTFReadChannel<Src::kG>(src, l)]++;
+        histogram[2][VTFReadChannel<Src::kB>(src, l)]++;
+        histogram[3][VTFReadChannel<Src::kA>(src, 255)]++;
+    }
+}
+
+// VTFHistogramPixels for pixels stored in a VTF format. Returns false for
+// formats without a byte-per-channel layout.
+inline bool VTFHistogramFromFormat(VTFImageFormat format, const uint8_t* src, size_t count, uint32_t histogram[4][256]) {
+    switch (format) {
+        case IMAGE_FORMAT_RGBA8888: VTFHistogramPixels<VTFLayout::RGBA8888>(src, count, histogram); return true;
+        case IMAGE_FORMAT_ABGR8888: VTFHistogramPixels<VTFLayout::ABGR8888>(src, count, histogram); return true;
+        case IMAGE_FORMAT_RGB888:   VTFHistogramPixels<VTFLayout::RGB888>(src, count, histogram);   return true;
+        case IMAGE_FORMAT_BGR888:   VTFHistogramPixels<VTFLayout::BGR888>(src, count, histogram);   return true;
+        case IMAGE_FORMAT_ARGB8888: VTFHistogramPixels<VTFLayout::ARGB8888>(src, count, histogram); return true;
+        case IMAGE_FORMAT_BGRA8888: VTFHistogramPixels<VTFLayout::BGRA8888>(src, count, histogram); return true;
+        case IMAGE_FORMAT_BGRX8888: VTFHistogramPixels<VTFLayout::BGRX8888>(src, count, histogram); return true;
+        case IMAGE_FORMAT_I8:       VTFHistogramPixels<VTFLayout::I8>(src, count, histogram);       return true;
+        case IMAGE_FORMAT_IA88:     VTFHistogramPixels<VTFLayout::IA88>(src, count, histogram);     return true;
+        case IMAGE_FORMAT_A8:       VTFHistogramPixels<VTFLayout::A8>(src, count, histogram);       return true;
+        default:                    return false;
+    }
+}
+
+// Whether every pixel in layout Src has alpha 255. The AND over a row has
+// no branches, so it vectorizes; rows end early once one is found.
+template <class Src>
+inline bool VTFPixelsOpaque(const uint8_t* src, size_t count) {
+    if (Src::kA < 0) return true;
+    
+    const size_t kRun = 4096;
+    for (size_t begin = 0; begin < count; begin += kRun) {
+        size_t end = (begin + kRun < count) ? begin + kRun : count;
+        uint8_t all = 255;
+        for (size_t i = begin; i < end; i++) all &= VTFReadChannel<Src::kA>(src + i * Src::kSize, 255);
+        if (all != 255) return false;
+    }
+    return true;
+}
+
+// VTFPixelsOpaque for pixels stored in a VTF format. Formats without a
+// byte-per-channel layout report false, as they can't be checked.
+inline bool VTFPixelsOpaqueInFormat(VTFImageFormat format, const uint8_t* src, size_t count) {
+    switch (format) {
+        case IMAGE_FORMAT_RGBA8888: return VTFPixelsOpaque<VTFLayout::RGBA8888>(src, count);
+        case IMAGE_FORMAT_ABGR8888: return VTFPixelsOpaque<VTFLayout::ABGR8888>(src, count);
+        case IMAGE_FORMAT_RGB888:   return VTFPixelsOpaque<VTFLayout::RGB888>(src, count);
+        case IMAGE_FORMAT_BGR888:   return VTFPixelsOpaque<VTFLayout::BGR888>(src, count);
+        case IMAGE_FORMAT_ARGB8888: return VTFPixelsOpaque<VTFLayout::ARGB8888>(src, count);
+        case IMAGE_FORMAT_BGRA8888: return VTFPixelsOpaque<VTFLayout::BGRA8888>(src, count);
+        case IMAGE_FORMAT_BGRX8888: return VTFPixelsOpaque<VTFLayout::BGRX8888>(src, count);
+        case IMAGE_FORMAT_I8:       return VTFPixelsOpaque<VTFLayout::I8>(src, count);
+        case IMAGE_FORMAT_IA88:     return VTFPixelsOpaque<VTFLayout::IA88>(src, count);
+        case IMAGE_FORMAT_A8:       return VTFPixelsOpaque<VTFLayout::A8>(src, count);
+        default:                    return false;
+    }
+}
+
+// Classifies the alpha of 'count' pixels in layout Src in one pass: the
+// AND of every alpha, and whether any lies strictly between 0 and 255.
+// Both are branch-free, so the loop vectorizes; runs end early once an
+// intermediate value is found.
+template <class Src>
+inline VTFAlphaClass VTFClassifyAlpha(const uint8_t* src, size_t count) {
+    if (Src::kA < 0) return ALPHA_CLASS_OPAQUE;
+    
+    const size_t kRun = 4096;
+    uint8_t all = 255;
+    for (size_t begin = 0; begin < count; begin += kRun) {
+        size_t end = (begin + kRun < count) ? begin + kRun : count;
+        uint8_t partial = 0;
+        for (size_t i = begin; i < end; i++) {
+            uint8_t a = VTFReadChannel<Src::kA>(src + i * Src::kSize, 255);
+            all &= a;
+            partial |= static_cast<uint8_t>(a - 1) < 254;
+        }
+        if (partial) return ALPHA_CLASS_EIGHTBIT;
+    }
+    return (all == 255) ? ALPHA_CLASS_OPAQUE : ALPHA_CLASS_ONEBIT;
+}
+
+// Whether R, G and B are equal in all 'count' pixels of layout Src. The
+// differences are ORed without branches, so the loop vectorizes; runs end
+// early once a coloured pixel is found.
+template <class Src>
+inline bool VTFPixelsGrayscale(const uint8_t* src, size_t count) {
+    if (Src::kL >= 0 || Src::kR < 0) return true;
+    
+    const size_t kRun = 4096;
+    for (size_t begin = 0; begin < count; begin += kRun) {
+        size_t end = (begin + kRun < count) ? begin + kRun : count;
+        uint8_t diff = 0;
+        for (size_t i = begin; i < end; i++) {
+            const uint8_t* pixel = src + i * Src::kSize;
+            uint8_t r = VTFReadChannel<Src::kR>(pixel, 0);
+            diff |= (r ^ VTFReadChannel<Src::kG>(pixel, 0)) | (r ^ VTFReadChannel<Src::kB>(pixel, 0));
+        }
+        if (diff) return false;
+    }
+    return true;
+}
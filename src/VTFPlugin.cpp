@@ -8,12 +8,17 @@
 //-------------------------------------------------------------------------------
 
 #include <windows.h>
+#include <io.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <string>
 #include <vector>
 #include <fstream>
+#include <mutex>
+#include <atomic>
+#include <list>
 
 #include "../win/resource.h"
 
@@ -54,6 +59,13 @@ static void DebugLogInt(const char* msg, int value) {
 #include "VTFFormat.h"
 #include "VTFLoader.h"
 #include "VTFWriter.h"
+#include "VTFThreadPool.h"
+#include "VTFBufferArena.h"
+#include "VTFAllocator.h"
+#include "VTFTerminology.h"
+#include "VTFHash.h"
+#include "VTFBlockCache.h"
+#include "VTFPixelConvert.h"
 
 //-------------------------------------------------------------------------------
 //	Plugin Entry Point Declaration
@@ -79,20 +91,45 @@ static VTFImageFormat s_lastFormat = IMAGE_FORMAT_DXT5;
 static uint32_t s_lastFlags = TEXTUREFLAGS_NORMAL | TEXTUREFLAGS_EIGHTBITALPHA;
 static bool s_lastMipmaps = true;
 
-// Plugin data structure
+// Largest single loader/writer buffer kept between documents (a 4K RGBA
+// image). Larger ones go back to the heap when the operation finishes.
+static const size_t kBufferTrimThreshold = 64 * 1024 * 1024;
+
+// Plugin data structure. It lives for the whole session, so the loader
+// and writer are reused by every open and save.
 struct VTFPluginData {
+    VTFBlockCache blockCache;
     VTFLoader* loader;
     VTFWriter* writer;
-    std::vector<uint8_t> imageData;
-    std::vector<uint8_t> fileData;
+    
+    // Host-backed and freed before every selector returns, so they aren't
+    // cached in an arena between calls
+    VTFArenaBuffer imageData;
+    VTFArenaBuffer fileData;
+    
     VTFImageFormat exportFormat;
     bool generateMipmaps;
     uint32_t flags;
+    float reflectivity[3];
+    
+    // Progress of the current read or write, in bytes
+    uint64_t ioDone;
+    uint64_t ioTotal;
+    
+    // Original file of the document being opened, if it was cached for
+    // passthrough saves (hash 0 when not)
+    uint64_t passthroughFileHash;
+    uint64_t passthroughFileSize;
     
     VTFPluginData() : loader(nullptr), writer(nullptr),
+                      imageData(nullptr), fileData(nullptr),
                       exportFormat(IMAGE_FORMAT_DXT5),
                       generateMipmaps(true),
-                      flags(TEXTUREFLAGS_NORMAL | TEXTUREFLAGS_EIGHTBITALPHA) {}
+                      flags(TEXTUREFLAGS_NORMAL | TEXTUREFLAGS_EIGHTBITALPHA),
+                      ioDone(0), ioTotal(0),
+                      passthroughFileHash(0), passthroughFileSize(0) {
+        reflectivity[0] = reflectivity[1] = reflectivity[2] = 0.5f;
+    }
     
     ~VTFPluginData() {
         delete loader;
@@ -102,6 +139,60 @@ struct VTFPluginData {
 
 VTFPluginData* gData = nullptr;
 
+// Plug-in resource recording the settings of the VTF a document was opened
+// from (or last saved with), so saving it again needs no dialog
+static const ResType kSettingsResourceType = 'vtfS';
+static const uint32_t kSettingsVersion = 1;
+
+// Flags describing the file's layout or its format's alpha rather than how
+// the texture is used. Saving writes one frame and face, and the alpha
+// flags come from the export format, so they aren't carried over.
+static const uint32_t kDerivedFlags = TEXTUREFLAGS_ENVMAP | TEXTUREFLAGS_ONEBITALPHA | TEXTUREFLAGS_EIGHTBITALPHA;
+
+struct VTFDocumentSettings {
+    uint32_t version;
+    uint32_t format;
+    uint32_t flags;
+    uint32_t mipmapCount;
+    uint32_t frames;
+    float reflectivity[3];
+};
+
+// Plug-in resource identifying the pixels a document was opened with and
+// the cached original file they came from
+static const ResType kPassthroughResourceType = 'vtfP';
+
+struct VTFPassthroughInfo {
+    uint64_t pixelHash;     // Of the interleaved pixels handed to Photoshop
+    uint64_t fileHash;      // Key into the passthrough cache
+    uint64_t fileSize;
+};
+
+// Original bytes of recently opened files. Saving a document whose pixels
+// and settings are unchanged writes these back instead of re-encoding.
+// The plugin isn't told when documents close, so the cache is kept small:
+// the least recently opened files are dropped first, and it is emptied
+// when the module unloads.
+static const size_t kPassthroughCacheBytes = 64 * 1024 * 1024;
+
+struct PassthroughEntry {
+    uint64_t fileHash;
+    VTFByteVector data;
+};
+static std::list<PassthroughEntry> sPassthroughCache;
+static size_t sPassthroughCacheSize = 0;
+
+// The shared worker pool and the passthrough cache outlive individual
+// selector calls and are torn down with the module's statics, which run
+// on DLL_PROCESS_DETACH
+static struct ModuleTeardown {
+    ~ModuleTeardown() {
+        VTFThreadPool::ShutdownForUnload();
+        std::list<PassthroughEntry>().swap(sPassthroughCache);
+        sPassthroughCacheSize = 0;
+    }
+} sModuleTeardown;
+
 //-------------------------------------------------------------------------------
 //	Prototypes
 //-------------------------------------------------------------------------------
@@ -116,12 +207,14 @@ static void DoReadFinish(void);
 
 // Write operations  
 static void DoWritePrepare(void);
+static int GetWritePlanes(void);
 static void DoWriteStart(void);
 static void DoWriteContinue(void);
 static void DoWriteFinish(void);
 
 // Options
 static void DoOptionsStart(void);
+static void DoOptionsDialog(void);
 static void DoOptionsContinue(void);
 static void DoOptionsFinish(void);
 
@@ -135,10 +228,26 @@ static void DoEstimateFinish(void);
 static void DoFilterFile(void);
 
 // Helpers
-static void ReadSome(int32 count, void* buffer);
-static void WriteSome(int32 count, void* buffer);
+static uint64 ReadSome(uint64 count, void* buffer);
+static void WriteSome(uint64 count, const void* buffer);
+static void BeginProgress(uint64 total);
+static void ReadAndDecode(uint64 offset);
+static bool LoadMappedDataFork(void);
+static void ReadDataFork(void);
 static VPoint GetFormatImageSize(void);
 static void SetFormatImageSize(VPoint inPoint);
+static void InstallHostAllocator(void);
+static bool ReadScriptParameters(void);
+static bool ReadDocumentResource(ResType type, void* data, size_t size);
+static void StoreDocumentResource(ResType type, const void* data, size_t size);
+static bool LoadDocumentSettings(void);
+static void StoreDocumentSettings(const VTFDocumentSettings& settings);
+static int FullMipmapCount(int width, int height);
+static void CachePassthroughFile(const uint8_t* data, uint64 size);
+static uint64_t HashPixels(const uint8_t* data, int width, int height, int planes);
+static bool WritePassthrough(int width, int height, int planes);
+static void WriteEncoded(int width, int height, int planes);
+static void WriteScriptParameters(void);
 
 //-------------------------------------------------------------------------------
 //	PluginMain
@@ -169,6 +278,9 @@ DLLExport MACPASCAL void PluginMain(const int16 selector,
         // Set up SPBasic suite
         sSPBasic = formatParamBlock->sSPBasic;
         
+        // Route large codec buffers through Photoshop's buffer suite
+        InstallHostAllocator();
+        
         // Enable 32-bit coordinates
         if (gFormatRecord->HostSupports32BitCoordinates)
             gFormatRecord->PluginUsing32BitCoordinates = true;
@@ -184,6 +296,14 @@ DLLExport MACPASCAL void PluginMain(const int16 selector,
             *data = reinterpret_cast<intptr_t>(gData);
         }
         
+        // Host-backed buffers must not outlive the call, even on an exception
+        struct CallBufferRelease {
+            ~CallBufferRelease() {
+                gData->fileData.release();
+                gData->imageData.release();
+            }
+        } callBufferRelease;
+        
         // Dispatch selector
         switch (selector) {
             // Read
@@ -262,12 +382,402 @@ DLLExport MACPASCAL void PluginMain(const int16 selector,
             PIUSuitesRelease();
         }
         
+    } catch (const std::bad_alloc&) {
+        if (result)
+            *result = memFullErr;
     } catch (...) {
         if (result)
             *result = formatBadParameters;
     }
 }
 
+//-------------------------------------------------------------------------------
+//	Host Memory
+//-------------------------------------------------------------------------------
+
+// Codec buffers of at least this size come from Photoshop's buffer suite,
+// so they count against its memory budget and it can purge caches or page
+// to the scratch disk to make room. Smaller ones stay on the heap.
+static const size_t kHostBufferMinSize = 256 * 1024;
+
+// Every block starts with a header recording which backend allocated it.
+// Sized to keep the payload 16-byte aligned.
+struct HostBlockHeader {
+    BufferID bufferID;      // nullptr for heap blocks
+};
+static const size_t kHostHeaderSize = 16;
+
+static std::mutex sHostMemoryMutex;
+static BufferProcs* sHostBufferProcs = nullptr;
+
+// Host buffers stay locked while they exist and the procs are only valid
+// for the current call, so only buffers freed before the selector returns
+// may use them: allocations come from the host only while a HostBufferScope
+// is open on the calling thread. Everything else (loader and writer
+// buffers, caches) lives on the heap.
+static thread_local bool sHostBufferScope = false;
+
+class HostBufferScope {
+public:
+    HostBufferScope() { sHostBufferScope = true; }
+    ~HostBufferScope() { sHostBufferScope = false; }
+};
+
+static void* HostAllocate(size_t size, void*) {
+    size_t total = size + kHostHeaderSize;
+    uint8_t* block = nullptr;
+    BufferID bufferID = nullptr;
+    
+    // Buffer procs take 32-bit sizes; anything larger uses the heap
+    if (sHostBufferScope && size >= kHostBufferMinSize && total <= static_cast<size_t>(INT_MAX)) {
+        std::lock_guard<std::mutex> lock(sHostMemoryMutex);
+        BufferProcs* procs = sHostBufferProcs;
+        if (procs && procs->allocateProc(static_cast<int32>(total), &bufferID) == noErr) {
+            block = reinterpret_cast<uint8_t*>(procs->lockProc(bufferID, true));
+            if (block == nullptr) {
+                procs->freeProc(bufferID);
+                bufferID = nullptr;
+            }
+        }
+    }
+    
+    // Heap fallback when the host has no room or the block doesn't qualify
+    if (block == nullptr) {
+        block = static_cast<uint8_t*>(malloc(total));
+        if (block == nullptr) return nullptr;
+        bufferID = nullptr;
+    }
+    
+    HostBlockHeader* header = reinterpret_cast<HostBlockHeader*>(block);
+    header->bufferID = bufferID;
+    return block + kHostHeaderSize;
+}
+
+static void HostDeallocate(void* ptr, size_t, void*) {
+    uint8_t* block = static_cast<uint8_t*>(ptr) - kHostHeaderSize;
+    HostBlockHeader* header = reinterpret_cast<HostBlockHeader*>(block);
+    
+    if (header->bufferID != nullptr) {
+        // Freed in the call that allocated it, so the procs are still current
+        std::lock_guard<std::mutex> lock(sHostMemoryMutex);
+        if (sHostBufferProcs != nullptr) {
+            sHostBufferProcs->unlockProc(header->bufferID);
+            sHostBufferProcs->freeProc(header->bufferID);
+        }
+    } else {
+        free(block);
+    }
+}
+
+// Picks up the current record's buffer procs, installing the hooks on
+// first use before any codec buffer exists
+static void InstallHostAllocator(void) {
+    static_assert(sizeof(HostBlockHeader) <= kHostHeaderSize, "header must fit");
+    
+    BufferProcs* procs = gFormatRecord->bufferProcs;
+    if (procs != nullptr && (procs->numBufferProcs < 4 ||
+        procs->allocateProc == nullptr || procs->lockProc == nullptr ||
+        procs->unlockProc == nullptr || procs->freeProc == nullptr)) {
+        procs = nullptr;
+    }
+    
+    {
+        std::lock_guard<std::mutex> lock(sHostMemoryMutex);
+        sHostBufferProcs = procs;
+    }
+    
+    static bool installed = false;
+    if (!installed) {
+        VTFAllocatorHooks hooks = { &HostAllocate, &HostDeallocate, nullptr };
+        VTFAllocator::SetHooks(&hooks);
+        installed = true;
+    }
+}
+
+//-------------------------------------------------------------------------------
+//	Scripting
+//-------------------------------------------------------------------------------
+
+static VTFImageFormat FormatFromScriptEnum(DescriptorEnumID value, VTFImageFormat fallback) {
+    switch (value) {
+        case enumVTFDXT1: return IMAGE_FORMAT_DXT1;
+        case enumVTFDXT5: return IMAGE_FORMAT_DXT5;
+        case enumVTFRGBA8888: return IMAGE_FORMAT_RGBA8888;
+        case enumVTFBGRA8888: return IMAGE_FORMAT_BGRA8888;
+        case enumVTFAuto: return IMAGE_FORMAT_AUTO;
+        case enumVTFAutoLossless: return IMAGE_FORMAT_AUTO_LOSSLESS;
+        default: return fallback;
+    }
+}
+
+static DescriptorEnumID ScriptEnumFromFormat(VTFImageFormat format) {
+    switch (format) {
+        case IMAGE_FORMAT_DXT1: return enumVTFDXT1;
+        case IMAGE_FORMAT_RGBA8888: return enumVTFRGBA8888;
+        case IMAGE_FORMAT_BGRA8888: return enumVTFBGRA8888;
+        case IMAGE_FORMAT_AUTO: return enumVTFAuto;
+        case IMAGE_FORMAT_AUTO_LOSSLESS: return enumVTFAutoLossless;
+        default: return enumVTFDXT5;
+    }
+}
+
+// Applies save settings passed by an action or script to gData.
+// Returns true if the host wants the options dialog shown.
+static bool ReadScriptParameters(void) {
+    PIDescriptorParameters* params = gFormatRecord->descriptorParameters;
+    if (params == nullptr) return true;
+    
+    ReadDescriptorProcs* procs = params->readDescriptorProcs;
+    if (params->descriptor != nullptr && procs != nullptr) {
+        DescriptorKeyID keys[] = { keyVTFFormat, keyVTFFlags, keyVTFMipmaps, 0 };
+        PIReadDescriptor token = procs->openReadDescriptorProc(params->descriptor, keys);
+        if (token != nullptr) {
+            DescriptorKeyID key = 0;
+            DescriptorTypeID type = 0;
+            int32 keyFlags = 0;
+            
+            while (procs->getKeyProc(token, &key, &type, &keyFlags)) {
+                switch (key) {
+                    case keyVTFFormat: {
+                        DescriptorEnumID value = 0;
+                        if (procs->getEnumeratedProc(token, &value) == noErr)
+                            gData->exportFormat = FormatFromScriptEnum(value, gData->exportFormat);
+                        break;
+                    }
+                    case keyVTFFlags: {
+                        int32 value = 0;
+                        if (procs->getIntegerProc(token, &value) == noErr)
+                            gData->flags = static_cast<uint32_t>(value);
+                        break;
+                    }
+                    case keyVTFMipmaps: {
+                        Boolean value = true;
+                        if (procs->getBooleanProc(token, &value) == noErr)
+                            gData->generateMipmaps = value != 0;
+                        break;
+                    }
+                }
+            }
+            
+            // Keys the descriptor lacks keep their current values
+            procs->closeReadDescriptorProc(token);
+        }
+        
+        gFormatRecord->handleProcs->disposeProc(params->descriptor);
+        params->descriptor = nullptr;
+    }
+    
+    return params->playInfo == plugInDialogDisplay;
+}
+
+// Hands the chosen save settings back to the host so they are recorded
+// into actions and returned to scripts
+static void WriteScriptParameters(void) {
+    PIDescriptorParameters* params = gFormatRecord->descriptorParameters;
+    if (params == nullptr || params->writeDescriptorProcs == nullptr) return;
+    
+    WriteDescriptorProcs* procs = params->writeDescriptorProcs;
+    PIWriteDescriptor token = procs->openWriteDescriptorProc();
+    if (token == nullptr) return;
+    
+    procs->putEnumeratedProc(token, keyVTFFormat, typeVTFFormat, ScriptEnumFromFormat(gData->exportFormat));
+    procs->putIntegerProc(token, keyVTFFlags, static_cast<int32>(gData->flags));
+    procs->putBooleanProc(token, keyVTFMipmaps, gData->generateMipmaps);
+    
+    if (params->descriptor != nullptr) {
+        gFormatRecord->handleProcs->disposeProc(params->descriptor);
+        params->descriptor = nullptr;
+    }
+    procs->closeWriteDescriptorProc(token, &params->descriptor);
+    params->recordInfo = plugInDialogOptional;
+}
+
+//-------------------------------------------------------------------------------
+//	Document Settings
+//-------------------------------------------------------------------------------
+
+// Copies the document's resource of the given type. Returns false if the
+// document has none or it is smaller than expected.
+static bool ReadDocumentResource(ResType type, void* data, size_t size) {
+    ResourceProcs* procs = gFormatRecord->resourceProcs;
+    HandleProcs* handles = gFormatRecord->handleProcs;
+    if (procs == nullptr || handles == nullptr) return false;
+    if (procs->countProc(type) < 1) return false;
+    
+    Handle h = procs->getProc(type, 1);
+    if (h == nullptr) return false;
+    if (handles->getSizeProc(h) < static_cast<int32>(size)) return false;
+    
+    Ptr p = handles->lockProc(h, false);
+    memcpy(data, p, size);
+    handles->unlockProc(h);
+    return true;
+}
+
+// Replaces the document's resource of the given type
+static void StoreDocumentResource(ResType type, const void* data, size_t size) {
+    ResourceProcs* procs = gFormatRecord->resourceProcs;
+    HandleProcs* handles = gFormatRecord->handleProcs;
+    if (procs == nullptr || handles == nullptr) return;
+    
+    Handle h = handles->newProc(static_cast<int32>(size));
+    if (h == nullptr) return;
+    
+    Ptr p = handles->lockProc(h, false);
+    memcpy(p, data, size);
+    handles->unlockProc(h);
+    
+    while (procs->countProc(type) > 0) {
+        procs->deleteProc(type, 1);
+    }
+    procs->addProc(type, h);
+    handles->disposeProc(h);
+}
+
+// Applies the settings resource of the document being saved to gData.
+// Returns false if the document has none.
+static bool LoadDocumentSettings(void) {
+    VTFDocumentSettings settings;
+    if (!ReadDocumentResource(kSettingsResourceType, &settings, sizeof(settings))) return false;
+    if (settings.version != kSettingsVersion) return false;
+    
+    // Formats the writer can't produce keep the sticky format
+    VTFImageFormat format = static_cast<VTFImageFormat>(settings.format);
+    switch (format) {
+        case IMAGE_FORMAT_AUTO:
+        case IMAGE_FORMAT_AUTO_LOSSLESS:
+        case IMAGE_FORMAT_DXT1:
+        case IMAGE_FORMAT_DXT1_ONEBITALPHA:
+        case IMAGE_FORMAT_DXT5:
+        case IMAGE_FORMAT_RGBA8888:
+        case IMAGE_FORMAT_BGRA8888:
+        case IMAGE_FORMAT_RGB888:
+        case IMAGE_FORMAT_BGR888:
+        case IMAGE_FORMAT_I8:
+        case IMAGE_FORMAT_IA88:
+            gData->exportFormat = format;
+            break;
+        default:
+            break;
+    }
+    gData->flags = (settings.flags & ~kDerivedFlags) | GetFormatAlphaFlags(gData->exportFormat);
+    gData->generateMipmaps = settings.mipmapCount > 1;
+    for (int c = 0; c < 3; c++) {
+        gData->reflectivity[c] = settings.reflectivity[c];
+    }
+    return true;
+}
+
+static void StoreDocumentSettings(const VTFDocumentSettings& settings) {
+    StoreDocumentResource(kSettingsResourceType, &settings, sizeof(settings));
+}
+
+// Mip count the writer produces for a full chain
+static int FullMipmapCount(int width, int height) {
+    int size = (width > height) ? width : height;
+    int count = 1;
+    while (size > 1) {
+        size /= 2;
+        count++;
+    }
+    return count;
+}
+
+//-------------------------------------------------------------------------------
+//	Passthrough
+//-------------------------------------------------------------------------------
+
+// Keeps a copy of the file being opened so an unchanged document can be
+// saved by writing it back. Files too large for the cache are skipped.
+static void CachePassthroughFile(const uint8_t* data, uint64 size) {
+    gData->passthroughFileHash = 0;
+    gData->passthroughFileSize = 0;
+    if (size < sizeof(VTFHeader) || size > kPassthroughCacheBytes / 2) return;
+    
+    uint64_t fileHash = VTFHash::Compute(data, static_cast<size_t>(size));
+    if (fileHash == 0) return;
+    
+    // Already cached: move it to the front
+    for (auto it = sPassthroughCache.begin(); it != sPassthroughCache.end(); ++it) {
+        if (it->fileHash == fileHash && it->data.size() == size) {
+            sPassthroughCache.splice(sPassthroughCache.begin(), sPassthroughCache, it);
+            gData->passthroughFileHash = fileHash;
+            gData->passthroughFileSize = size;
+            return;
+        }
+    }
+    
+    while (!sPassthroughCache.empty() && sPassthroughCacheSize + size > kPassthroughCacheBytes) {
+        sPassthroughCacheSize -= sPassthroughCache.back().data.size();
+        sPassthroughCache.pop_back();
+    }
+    
+    sPassthroughCache.push_front(PassthroughEntry());
+    PassthroughEntry& entry = sPassthroughCache.front();
+    entry.fileHash = fileHash;
+    entry.data.assign(data, data + size);
+    sPassthroughCacheSize += entry.data.size();
+    
+    gData->passthroughFileHash = fileHash;
+    gData->passthroughFileSize = size;
+}
+
+// Hash of the interleaved pixels exchanged with Photoshop; the layout is
+// part of the seed so the same bytes in another shape don't match
+static uint64_t HashPixels(const uint8_t* data, int width, int height, int planes) {
+    uint64_t seed = (static_cast<uint64_t>(width) << 32) ^ (static_cast<uint64_t>(height) << 8) ^ planes;
+    return VTFHash::Compute(data, static_cast<size_t>(width) * height * planes, seed);
+}
+
+// Writes the original file back when the document still holds exactly the
+// pixels it was opened with and the settings would encode the same image.
+// The editable flags and reflectivity only live in the header, so they are
+// patched; the flags describing the stored layout and alpha are kept.
+// Returns false, without touching the data fork, when it doesn't apply.
+static bool WritePassthrough(int width, int height, int planes) {
+    VTFPassthroughInfo info;
+    if (!ReadDocumentResource(kPassthroughResourceType, &info, sizeof(info))) return false;
+    
+    const PassthroughEntry* entry = nullptr;
+    for (const PassthroughEntry& candidate : sPassthroughCache) {
+        if (candidate.fileHash == info.fileHash && candidate.data.size() == info.fileSize) {
+            entry = &candidate;
+            break;
+        }
+    }
+    if (entry == nullptr) return false;
+    
+    VTFHeader header;
+    memcpy(&header, entry->data.data(), sizeof(VTFHeader));
+    
+    int mipmapCount = gData->generateMipmaps ? FullMipmapCount(width, height) : 1;
+    if (header.width != width || header.height != height ||
+        header.highResImageFormat != static_cast<uint32_t>(gData->exportFormat) ||
+        header.mipmapCount != mipmapCount) {
+        return false;
+    }
+    
+    if (HashPixels(gData->imageData.data(), width, height, planes) != info.pixelHash) return false;
+    DebugLog("Pixels unchanged, writing original file back");
+    
+    header.flags = (header.flags & kDerivedFlags) | (gData->flags & ~kDerivedFlags);
+    for (int c = 0; c < 3; c++) {
+        header.reflectivity[c] = gData->reflectivity[c];
+    }
+    
+    *gResult = PSSDKSetFPos(gFormatRecord->dataFork,
+                            gFormatRecord->posixFileDescriptor,
+                            gFormatRecord->pluginUsingPOSIXIO,
+                            fsFromStart, 0);
+    if (*gResult != noErr) return true;
+    
+    BeginProgress(entry->data.size());
+    WriteSome(sizeof(VTFHeader), &header);
+    if (*gResult != noErr) return true;
+    WriteSome(entry->data.size() - sizeof(VTFHeader), entry->data.data() + sizeof(VTFHeader));
+    return true;
+}
+
 //-------------------------------------------------------------------------------
 //	DoAbout
 //-------------------------------------------------------------------------------
@@ -291,34 +801,197 @@ static void DoAbout(void) {
 //	File I/O Helpers
 //-------------------------------------------------------------------------------
 
-static void ReadSome(int32 count, void* buffer) {
+// Transfers are split into bounded chunks: the SDK file procs only take
+// int32 counts, and the host gets a chance to update progress and cancel
+// between chunks instead of stalling on one huge call
+static const uint64 kIOChunkSize = 8 * 1024 * 1024;
+
+// Sets the byte count that following ReadSome/WriteSome calls report
+// progress against. Zero disables progress reporting.
+static void BeginProgress(uint64 total) {
+    gData->ioDone = 0;
+    gData->ioTotal = total;
+}
+
+// Accounts for a finished chunk, reports progress and polls for cancel.
+// Returns false (with *gResult set) when the user aborted.
+static bool UpdateProgress(uint64 bytes) {
+    gData->ioDone += bytes;
+    
+    if (gData->ioTotal > 0 && gFormatRecord->progressProc) {
+        // Report in KB so multi-gigabyte files fit the int32 progress proc
+        uint64 done = gData->ioDone < gData->ioTotal ? gData->ioDone : gData->ioTotal;
+        gFormatRecord->progressProc(static_cast<int32>((done + 1023) >> 10),
+                                    static_cast<int32>((gData->ioTotal + 1023) >> 10));
+    }
+    
+    if (gFormatRecord->abortProc && gFormatRecord->abortProc()) {
+        *gResult = userCanceledErr;
+        return false;
+    }
+    return true;
+}
+
+// Returns the number of bytes actually read; a short read sets eofErr
+static uint64 ReadSome(uint64 count, void* buffer) {
+    if (*gResult != noErr) return 0;
+    
+    uint8_t* dst = static_cast<uint8_t*>(buffer);
+    uint64 done = 0;
+    while (done < count) {
+        int32 chunk = static_cast<int32>((count - done < kIOChunkSize) ? count - done : kIOChunkSize);
+        
+        int32 readCount = chunk;
+        *gResult = PSSDKRead(gFormatRecord->dataFork,
+                             gFormatRecord->posixFileDescriptor,
+                             gFormatRecord->pluginUsingPOSIXIO,
+                             &readCount,
+                             dst + done);
+        if (readCount > 0) done += readCount;
+        
+        if (*gResult == noErr && readCount != chunk) {
+            *gResult = eofErr;
+        }
+        if (*gResult != noErr) break;
+        if (!UpdateProgress(readCount)) break;
+    }
+    return done;
+}
+
+static void WriteSome(uint64 count, const void* buffer) {
     if (*gResult != noErr) return;
     
-    int32 readCount = count;
-    *gResult = PSSDKRead(gFormatRecord->dataFork,
-                         gFormatRecord->posixFileDescriptor,
-                         gFormatRecord->pluginUsingPOSIXIO,
-                         &readCount,
-                         buffer);
+    uint8_t* src = static_cast<uint8_t*>(const_cast<void*>(buffer));
+    uint64 done = 0;
+    while (done < count) {
+        int32 chunk = static_cast<int32>((count - done < kIOChunkSize) ? count - done : kIOChunkSize);
+        
+        int32 writeCount = chunk;
+        *gResult = PSSDKWrite(gFormatRecord->dataFork,
+                              gFormatRecord->posixFileDescriptor,
+                              gFormatRecord->pluginUsingPOSIXIO,
+                              &writeCount,
+                              src + done);
+        
+        if (*gResult == noErr && writeCount != chunk) {
+            *gResult = dskFulErr;
+        }
+        if (*gResult != noErr) break;
+        
+        done += writeCount;
+        if (!UpdateProgress(writeCount)) break;
+    }
+}
+
+//-------------------------------------------------------------------------------
+//	Pipelined Read
+//-------------------------------------------------------------------------------
+
+// Reads gData->fileData from 'offset' to the end, handing each chunk to the
+// loader as it lands. Mip 0 is stored last, so on large files the pool
+// decodes its rows while the remaining chunks are still being read.
+static void ReadAndDecode(uint64 offset) {
+    uint8_t* fileData = gData->fileData.data();
+    uint64 totalSize = gData->fileData.size();
+    VTFLoader* loader = gData->loader;
+    
+    // Small files: read everything, then decode on this thread
+    if (totalSize - offset <= kIOChunkSize) {
+        offset += ReadSome(totalSize - offset, fileData + offset);
+        // Short reads are reported as truncation by the loader
+        if (*gResult == eofErr) *gResult = noErr;
+        if (*gResult != noErr) return;
+        
+        loader->DecodeResident(offset);
+        return;
+    }
     
-    if (*gResult == noErr && readCount != count) {
-        *gResult = eofErr;
+    // At most one decode task runs at a time. It decodes what is resident
+    // and ends rather than waiting for more, so it never holds a worker
+    // idle; the next chunk starts a new one if it has already finished.
+    std::atomic<uint64> residentBytes(offset);
+    std::atomic<bool> decoding(false);
+    VTFThreadPool::TaskGroup decoder;
+    
+    auto decodeResident = [&]() {
+        if (decoding.exchange(true)) return;
+        decoder.Run([&]() {
+            for (;;) {
+                uint64 target = residentBytes.load();
+                loader->DecodeResident(target);
+                decoding.store(false);
+                
+                // Carry on with bytes that landed meanwhile, unless a new
+                // task was started for them
+                if (residentBytes.load() == target || decoding.exchange(true)) break;
+            }
+        });
+    };
+    
+    while (offset < totalSize) {
+        uint64 chunk = totalSize - offset;
+        if (chunk > kIOChunkSize) chunk = kIOChunkSize;
+        
+        offset += ReadSome(chunk, fileData + offset);
+        residentBytes.store(offset);
+        decodeResident();
+        
+        if (*gResult != noErr) break;
     }
+    
+    decoder.Wait();
+    
+    // Short reads are reported as truncation by the loader
+    if (*gResult == eofErr) *gResult = noErr;
 }
 
-static void WriteSome(int32 count, void* buffer) {
-    if (*gResult != noErr) return;
+//-------------------------------------------------------------------------------
+//	Mapped Read
+//-------------------------------------------------------------------------------
+
+// Maps the data fork read-only and decodes it in place, so even a large
+// uncompressed file is never copied to the heap. Returns false with
+// *gResult == noErr when mapping isn't possible and the caller should
+// fall back to buffered reads.
+static bool LoadMappedDataFork(void) {
+    if (!gFormatRecord->pluginUsingPOSIXIO) return false;
+    
+    HANDLE file = reinterpret_cast<HANDLE>(_get_osfhandle(gFormatRecord->posixFileDescriptor));
+    if (file == INVALID_HANDLE_VALUE) return false;
+    
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart < static_cast<LONGLONG>(sizeof(VTFHeader))) {
+        return false;
+    }
+    
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping == nullptr) return false;
+    
+    const uint8_t* view = static_cast<const uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    if (view == nullptr) {
+        CloseHandle(mapping);
+        return false;
+    }
+    DebugLog("Mapped data fork");
+    
+    if (!gData->loader) {
+        gData->loader = new VTFLoader();
+        gData->loader->SetOutputChannels(0);
+    }
     
-    int32 writeCount = count;
-    *gResult = PSSDKWrite(gFormatRecord->dataFork,
-                          gFormatRecord->posixFileDescriptor,
-                          gFormatRecord->pluginUsingPOSIXIO,
-                          &writeCount,
-                          buffer);
+    // The loader decodes into its own buffer, so the view can go right away
+    bool loaded = gData->loader->LoadFromMemory(view, static_cast<size_t>(fileSize.QuadPart));
+    if (loaded) {
+        CachePassthroughFile(view, fileSize.QuadPart);
+    }
+    UnmapViewOfFile(view);
+    CloseHandle(mapping);
     
-    if (*gResult == noErr && writeCount != count) {
-        *gResult = dskFulErr;
+    if (!loaded) {
+        DebugLog("LoadFromMemory FAILED");
+        *gResult = formatCannotRead;
     }
+    return true;
 }
 
 //-------------------------------------------------------------------------------
@@ -330,10 +1003,8 @@ static void DoReadPrepare(void) {
     *gResult = noErr;
 }
 
-static void DoReadStart(void) {
-    DebugLog("DoReadStart called");
-    *gResult = noErr;
-    
+// Buffered read of the whole data fork into fileData, decoding as it lands
+static void ReadDataFork(void) {
     // Seek to start of file
     *gResult = PSSDKSetFPos(gFormatRecord->dataFork,
                             gFormatRecord->posixFileDescriptor,
@@ -366,27 +1037,11 @@ static void DoReadStart(void) {
         return;
     }
     
-    // Calculate total data size needed
-    VTFImageFormat format = static_cast<VTFImageFormat>(header.highResImageFormat);
-    int width = header.width;
-    int height = header.height;
-    int mipmapCount = header.mipmapCount;
-    int frameCount = header.frames;
-    if (frameCount < 1) frameCount = 1;
-    if (mipmapCount < 1) mipmapCount = 1;
-    
-    // Calculate total image data size (all mipmaps, all frames)
-    size_t imageDataSize = 0;
-    int mipWidth = width;
-    int mipHeight = height;
-    for (int mip = 0; mip < mipmapCount; mip++) {
-        imageDataSize += CalculateImageSize(mipWidth, mipHeight, format) * frameCount;
-        mipWidth = (mipWidth > 1) ? mipWidth / 2 : 1;
-        mipHeight = (mipHeight > 1) ? mipHeight / 2 : 1;
-    }
+    // Calculate total image data size (all mipmaps, frames, faces and slices)
+    uint64 imageDataSize = CalculateHighResSize(header);
     
     // Add low-res thumbnail size if present
-    size_t lowResSize = 0;
+    uint64 lowResSize = 0;
     if (header.lowResImageFormat != IMAGE_FORMAT_NONE && 
         header.lowResImageWidth > 0 && header.lowResImageHeight > 0) {
         lowResSize = CalculateImageSize(header.lowResImageWidth, header.lowResImageHeight,
@@ -394,37 +1049,62 @@ static void DoReadStart(void) {
     }
     
     // Total file size = header + lowres + image data
-    size_t totalSize = header.headerSize + lowResSize + imageDataSize;
+    uint64 totalSize = header.headerSize + lowResSize + imageDataSize;
+    if (totalSize < sizeof(VTFHeader)) totalSize = sizeof(VTFHeader);
+    BeginProgress(totalSize);
+    
+    // Allocate the whole file; the header we already have goes in front
+    // so the rest can be read in a single pass without seeking back
+    {
+        HostBufferScope hostScope;
+        gData->fileData.resize(totalSize);
+    }
+    memcpy(gData->fileData.data(), &header, sizeof(VTFHeader));
     
-    // Allocate and read entire file
-    gData->fileData.resize(totalSize);
+    // Create loader (or reuse the last one) and parse. It decodes straight
+    // into the document's layout: RGB, or RGBA when the format has alpha
+    // and some pixel isn't opaque.
+    if (!gData->loader) {
+        gData->loader = new VTFLoader();
+        gData->loader->SetOutputChannels(0);
+    }
     
-    // Seek back to start and read everything
-    *gResult = PSSDKSetFPos(gFormatRecord->dataFork,
-                            gFormatRecord->posixFileDescriptor,
-                            gFormatRecord->pluginUsingPOSIXIO,
-                            fsFromStart, 0);
+    DebugLog("Calling BeginStream");
+    if (!gData->loader->BeginStream(gData->fileData.data(), gData->fileData.size())) {
+        DebugLog("BeginStream FAILED");
+        *gResult = formatCannotRead;
+        return;
+    }
+    
+    ReadAndDecode(sizeof(VTFHeader));
     if (*gResult != noErr) return;
     
-    ReadSome(static_cast<int32>(totalSize), gData->fileData.data());
-    if (*gResult != noErr) {
-        // Try reading what we can
-        *gResult = noErr;
+    if (!gData->loader->FinishStream()) {
+        DebugLog("FinishStream FAILED");
+        *gResult = formatCannotRead;
+        return;
     }
+    DebugLog("Decode succeeded");
     
-    // Create loader and parse
-    if (gData->loader) {
-        delete gData->loader;
+    // Before 7.3 the header describes every byte, so what was read is the
+    // whole file; later versions may keep resource data we didn't read
+    if (header.version[1] < 3) {
+        CachePassthroughFile(gData->fileData.data(), totalSize);
     }
-    gData->loader = new VTFLoader();
+}
+
+static void DoReadStart(void) {
+    DebugLog("DoReadStart called");
+    *gResult = noErr;
+    BeginProgress(0);
+    gData->passthroughFileHash = 0;
     
-    DebugLog("Calling LoadFromMemory");
-    if (!gData->loader->LoadFromMemory(gData->fileData.data(), gData->fileData.size())) {
-        DebugLog("LoadFromMemory FAILED");
-        *gResult = formatCannotRead;
-        return;
+    // Decode straight out of a mapping of the data fork when the host gave
+    // us a POSIX descriptor, otherwise read it into fileData
+    if (!LoadMappedDataFork()) {
+        ReadDataFork();
     }
-    DebugLog("LoadFromMemory succeeded");
+    if (*gResult != noErr) return;
     
     // Set up document
     bool hasAlpha = gData->loader->HasAlpha();
@@ -432,9 +1112,23 @@ static void DoReadStart(void) {
     DebugLogInt("Height", gData->loader->GetHeight());
     DebugLogInt("HasAlpha", hasAlpha ? 1 : 0);
     
-    gFormatRecord->imageMode = plugInModeRGBColor;
+    // I8 and IA88 files decode to gray, with alpha when it's used
+    int channels = gData->loader->GetChannelCount();
+    gFormatRecord->imageMode = (channels <= 2) ? plugInModeGrayScale : plugInModeRGBColor;
     gFormatRecord->depth = 8;
-    gFormatRecord->planes = hasAlpha ? 4 : 3;
+    gFormatRecord->planes = channels;
+    
+    // Remember how the file was encoded so saving it again reuses it
+    VTFDocumentSettings settings;
+    settings.version = kSettingsVersion;
+    settings.format = gData->loader->GetFormat();
+    settings.flags = gData->loader->GetFlags() & ~kDerivedFlags;
+    settings.mipmapCount = gData->loader->GetMipmapCount();
+    settings.frames = gData->loader->GetFrameCount();
+    for (int c = 0; c < 3; c++) {
+        settings.reflectivity[c] = gData->loader->GetReflectivity(c);
+    }
+    StoreDocumentSettings(settings);
     
     VPoint imageSize;
     imageSize.h = gData->loader->GetWidth();
@@ -491,27 +1185,22 @@ static void DoReadContinue(void) {
     gFormatRecord->rowBytes = width * planes;
     gFormatRecord->planeBytes = 1;
     
-    // Allocate buffer and copy data
-    size_t bufferSize = static_cast<size_t>(width) * height * planes;
-    gData->imageData.resize(bufferSize);
-    
-    // Convert from RGBA to interleaved
-    uint8_t* dst = gData->imageData.data();
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            int srcIdx = (y * width + x) * 4;
-            int dstIdx = (y * width + x) * planes;
-            
-            dst[dstIdx + 0] = rgbaData[srcIdx + 0]; // R
-            dst[dstIdx + 1] = rgbaData[srcIdx + 1]; // G
-            dst[dstIdx + 2] = rgbaData[srcIdx + 2]; // B
-            if (planes > 3) {
-                dst[dstIdx + 3] = rgbaData[srcIdx + 3]; // A
-            }
-        }
+    // The loader already decoded into the document's interleaved layout,
+    // so its buffer goes to Photoshop as is (it is only read from)
+    if (gData->loader->GetChannelCount() != planes) {
+        *gResult = formatCannotRead;
+        return;
+    }
+    gFormatRecord->data = const_cast<uint8_t*>(rgbaData);
+    
+    // Tie the pixels to the cached original so an unedited save can reuse it
+    if (gData->passthroughFileHash != 0) {
+        VTFPassthroughInfo info;
+        info.pixelHash = HashPixels(rgbaData, width, height, planes);
+        info.fileHash = gData->passthroughFileHash;
+        info.fileSize = gData->passthroughFileSize;
+        StoreDocumentResource(kPassthroughResourceType, &info, sizeof(info));
     }
-    
-    gFormatRecord->data = gData->imageData.data();
     
     DebugLog("Calling advanceState");
     // Advance state to write data to Photoshop
@@ -535,14 +1224,9 @@ static void DoReadContinue(void) {
 }
 
 static void DoReadFinish(void) {
-    gData->imageData.clear();
-    gData->imageData.shrink_to_fit();
-    gData->fileData.clear();
-    gData->fileData.shrink_to_fit();
-    
+    // The loader is kept for the next open
     if (gData->loader) {
-        delete gData->loader;
-        gData->loader = nullptr;
+        gData->loader->Trim(kBufferTrimThreshold);
     }
     
     *gResult = noErr;
@@ -557,13 +1241,22 @@ static void DoWritePrepare(void) {
     *gResult = noErr;
 }
 
+// Planes requested from Photoshop and written: colour (or gray) plus one
+// alpha channel at most. Further channels are left out of the buffer, so
+// its pixels are exactly this many bytes apart.
+static int GetWritePlanes(void) {
+    int maxPlanes = (gFormatRecord->imageMode == plugInModeGrayScale) ? 2 : 4;
+    return (gFormatRecord->planes > maxPlanes) ? maxPlanes : gFormatRecord->planes;
+}
+
 static void DoWriteStart(void) {
     *gResult = noErr;
+    BeginProgress(0);
     
     VPoint imageSize = GetFormatImageSize();
     int width = imageSize.h;
     int height = imageSize.v;
-    int planes = gFormatRecord->planes;
+    int planes = GetWritePlanes();
     
     // Request data from Photoshop
     VRect theRect;
@@ -582,15 +1275,13 @@ static void DoWriteStart(void) {
     }
     
     gFormatRecord->loPlane = 0;
-    gFormatRecord->hiPlane = (planes > 3) ? 3 : planes - 1;
+    gFormatRecord->hiPlane = planes - 1;
     gFormatRecord->colBytes = planes;
     gFormatRecord->rowBytes = width * planes;
     gFormatRecord->planeBytes = 1;
     
-    // Allocate buffer
-    size_t bufferSize = static_cast<size_t>(width) * height * planes;
-    gData->imageData.resize(bufferSize);
-    gFormatRecord->data = gData->imageData.data();
+    // The buffer is allocated in WriteContinue, which also frees it
+    gFormatRecord->data = nullptr;
 }
 
 static void DoWriteContinue(void) {
@@ -599,57 +1290,25 @@ static void DoWriteContinue(void) {
     VPoint imageSize = GetFormatImageSize();
     int width = imageSize.h;
     int height = imageSize.v;
-    int planes = gFormatRecord->planes;
-    bool hasAlpha = planes > 3;
+    int planes = GetWritePlanes();
+    
+    // Allocate buffer; it's released when this call returns
+    {
+        HostBufferScope hostScope;
+        gData->imageData.resize(static_cast<size_t>(width) * height * planes);
+    }
+    gFormatRecord->data = gData->imageData.data();
     
     // Get data from Photoshop
     *gResult = gFormatRecord->advanceState();
     if (*gResult != noErr) return;
     
-    // Create writer
-    if (gData->writer) {
-        delete gData->writer;
-    }
-    gData->writer = new VTFWriter();
-    
-    // Convert from interleaved to RGBA
-    std::vector<uint8_t> rgbaData(width * height * 4);
-    const uint8_t* src = gData->imageData.data();
-    
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            int srcIdx = (y * width + x) * planes;
-            int dstIdx = (y * width + x) * 4;
-            
-            rgbaData[dstIdx + 0] = src[srcIdx + 0]; // R
-            rgbaData[dstIdx + 1] = src[srcIdx + 1]; // G
-            rgbaData[dstIdx + 2] = src[srcIdx + 2]; // B
-            rgbaData[dstIdx + 3] = hasAlpha ? src[srcIdx + 3] : 255; // A
-        }
-    }
-    
-    // Set up writer
-    gData->writer->SetImageData(rgbaData.data(), width, height, hasAlpha);
-    gData->writer->SetFormat(gData->exportFormat);
-    gData->writer->SetGenerateMipmaps(gData->generateMipmaps);
-    gData->writer->SetFlags(gData->flags);
-    
-    // Generate VTF data
-    std::vector<uint8_t> vtfData;
-    if (!gData->writer->WriteToMemory(vtfData)) {
-        *gResult = writErr;
-        return;
+    // An unedited document is saved by writing its original file back
+    if (!WritePassthrough(width, height, planes)) {
+        WriteEncoded(width, height, planes);
     }
-    
-    // Seek to start and write
-    *gResult = PSSDKSetFPos(gFormatRecord->dataFork,
-                            gFormatRecord->posixFileDescriptor,
-                            gFormatRecord->pluginUsingPOSIXIO,
-                            fsFromStart, 0);
     if (*gResult != noErr) return;
     
-    WriteSome(static_cast<int32>(vtfData.size()), vtfData.data());
-    
     // Signal done
     if (gFormatRecord->PluginUsing32BitCoordinates) {
         gFormatRecord->theRect32.left = 0;
@@ -666,13 +1325,63 @@ static void DoWriteContinue(void) {
     gFormatRecord->data = nullptr;
 }
 
-static void DoWriteFinish(void) {
-    gData->imageData.clear();
-    gData->imageData.shrink_to_fit();
+// Encodes the image with the chosen settings and writes it to the data fork
+static void WriteEncoded(int width, int height, int planes) {
+    bool gray = gFormatRecord->imageMode == plugInModeGrayScale;
+    bool hasAlpha = planes > (gray ? 1 : 3);
+    
+    // Create writer (or reuse the last one). Repeated saves of an edited
+    // image then re-encode only the blocks whose pixels changed.
+    if (!gData->writer) {
+        gData->writer = new VTFWriter();
+        gData->writer->SetIncremental(true);
+        gData->writer->SetBlockCache(&gData->blockCache);
+    }
     
+    // Convert from interleaved straight into the writer's RGBA buffer
+    uint8_t* rgbaData = gData->writer->PrepareImageData(width, height, hasAlpha);
+    const uint8_t* src = gData->imageData.data();
+    size_t pixelCount = static_cast<size_t>(width) * height;
+    
+    if (gray && hasAlpha) {
+        VTFConvertPixels<VTFLayout::HostGrayAlpha, VTFLayout::RGBA8888>(src, rgbaData, pixelCount);
+    } else if (gray) {
+        VTFConvertPixels<VTFLayout::HostGray, VTFLayout::RGBA8888>(src, rgbaData, pixelCount);
+    } else if (hasAlpha) {
+        VTFConvertPixels<VTFLayout::HostRGBA, VTFLayout::RGBA8888>(src, rgbaData, pixelCount);
+    } else {
+        VTFConvertPixels<VTFLayout::HostRGB, VTFLayout::RGBA8888>(src, rgbaData, pixelCount);
+    }
+    
+    // Set up writer
+    gData->writer->SetFormat(gData->exportFormat);
+    gData->writer->SetGenerateMipmaps(gData->generateMipmaps);
+    gData->writer->SetFlags(gData->flags);
+    gData->writer->SetReflectivity(gData->reflectivity[0], gData->reflectivity[1], gData->reflectivity[2]);
+    
+    // Seek to start
+    *gResult = PSSDKSetFPos(gFormatRecord->dataFork,
+                            gFormatRecord->posixFileDescriptor,
+                            gFormatRecord->pluginUsingPOSIXIO,
+                            fsFromStart, 0);
+    if (*gResult != noErr) return;
+    
+    // Write the header and each mip band straight to the data fork as the
+    // writer produces them, without staging the whole file
+    BeginProgress(gData->writer->CalculateFileSize());
+    bool written = gData->writer->WriteSegments([](const uint8_t* data, size_t size) {
+        WriteSome(size, data);
+        return *gResult == noErr;
+    });
+    if (!written && *gResult == noErr) {
+        *gResult = writErr;
+    }
+}
+
+static void DoWriteFinish(void) {
+    // The writer is kept for the next save
     if (gData->writer) {
-        delete gData->writer;
-        gData->writer = nullptr;
+        gData->writer->Trim(kBufferTrimThreshold);
     }
     
     *gResult = noErr;
@@ -702,31 +1411,39 @@ static INT_PTR CALLBACK VTFOptionsDlgProc(HWND hDlg, UINT message, WPARAM wParam
             
             idx = (int)SendMessageA(hCombo, CB_ADDSTRING, 0, (LPARAM)"BGRA8888 (Uncompressed)");
             SendMessageA(hCombo, CB_SETITEMDATA, idx, IMAGE_FORMAT_BGRA8888);
+            
+            idx = (int)SendMessageA(hCombo, CB_ADDSTRING, 0, (LPARAM)"Auto (DXT1, DXT1A or DXT5 by Alpha)");
+            SendMessageA(hCombo, CB_SETITEMDATA, idx, IMAGE_FORMAT_AUTO);
+            
+            idx = (int)SendMessageA(hCombo, CB_ADDSTRING, 0, (LPARAM)"Auto Lossless (I8, IA88, RGB888 or RGBA8888)");
+            SendMessageA(hCombo, CB_SETITEMDATA, idx, IMAGE_FORMAT_AUTO_LOSSLESS);
 
-            // Set Default Selection (from persistent settings)
+            // Set Default Selection (from the settings DoOptionsStart picked)
             int comboIndex = 1; // Default DXT5
-            switch (s_lastFormat) {
+            switch (gData->exportFormat) {
                 case IMAGE_FORMAT_DXT1: comboIndex = 0; break;
                 case IMAGE_FORMAT_DXT5: comboIndex = 1; break;
                 case IMAGE_FORMAT_RGBA8888: comboIndex = 2; break;
                 case IMAGE_FORMAT_BGRA8888: comboIndex = 3; break;
+                case IMAGE_FORMAT_AUTO: comboIndex = 4; break;
+                case IMAGE_FORMAT_AUTO_LOSSLESS: comboIndex = 5; break;
             }
             SendMessageA(hCombo, CB_SETCURSEL, comboIndex, 0);
             
-            // Set Checkboxes from persistent flags
-            if (s_lastMipmaps) CheckDlgButton(hDlg, IDC_CHK_MIPMAPS, BST_CHECKED);
+            // Set Checkboxes from the current flags
+            if (gData->generateMipmaps) CheckDlgButton(hDlg, IDC_CHK_MIPMAPS, BST_CHECKED);
             
-            if (s_lastFlags & TEXTUREFLAGS_POINTSAMPLE) CheckDlgButton(hDlg, IDC_CHK_POINTSAMPLE, BST_CHECKED);
-            if (s_lastFlags & TEXTUREFLAGS_TRILINEAR) CheckDlgButton(hDlg, IDC_CHK_TRILINEAR, BST_CHECKED);
-            if (s_lastFlags & TEXTUREFLAGS_CLAMPS) CheckDlgButton(hDlg, IDC_CHK_CLAMPS, BST_CHECKED);
-            if (s_lastFlags & TEXTUREFLAGS_CLAMPT) CheckDlgButton(hDlg, IDC_CHK_CLAMPT, BST_CHECKED);
-            if (s_lastFlags & TEXTUREFLAGS_ANISOTROPIC) CheckDlgButton(hDlg, IDC_CHK_ANISOTROPIC, BST_CHECKED);
-            if (s_lastFlags & TEXTUREFLAGS_HINT_DXT5) CheckDlgButton(hDlg, IDC_CHK_HINTDXT5, BST_CHECKED);
-            if (s_lastFlags & TEXTUREFLAGS_NORMAL) CheckDlgButton(hDlg, IDC_CHK_NORMAL, BST_CHECKED);
-            if (s_lastFlags & TEXTUREFLAGS_NOMIP) CheckDlgButton(hDlg, IDC_CHK_NOMIP, BST_CHECKED);
-            if (s_lastFlags & TEXTUREFLAGS_NOLOD) CheckDlgButton(hDlg, IDC_CHK_NOLOD, BST_CHECKED);
-            if (s_lastFlags & TEXTUREFLAGS_ALL_MIPS) CheckDlgButton(hDlg, IDC_CHK_MINMIP, BST_CHECKED);
-            if (s_lastFlags & TEXTUREFLAGS_PRE_SRGB) CheckDlgButton(hDlg, IDC_CHK_SRGB, BST_CHECKED);
+            if (gData->flags & TEXTUREFLAGS_POINTSAMPLE) CheckDlgButton(hDlg, IDC_CHK_POINTSAMPLE, BST_CHECKED);
+            if (gData->flags & TEXTUREFLAGS_TRILINEAR) CheckDlgButton(hDlg, IDC_CHK_TRILINEAR, BST_CHECKED);
+            if (gData->flags & TEXTUREFLAGS_CLAMPS) CheckDlgButton(hDlg, IDC_CHK_CLAMPS, BST_CHECKED);
+            if (gData->flags & TEXTUREFLAGS_CLAMPT) CheckDlgButton(hDlg, IDC_CHK_CLAMPT, BST_CHECKED);
+            if (gData->flags & TEXTUREFLAGS_ANISOTROPIC) CheckDlgButton(hDlg, IDC_CHK_ANISOTROPIC, BST_CHECKED);
+            if (gData->flags & TEXTUREFLAGS_HINT_DXT5) CheckDlgButton(hDlg, IDC_CHK_HINTDXT5, BST_CHECKED);
+            if (gData->flags & TEXTUREFLAGS_NORMAL) CheckDlgButton(hDlg, IDC_CHK_NORMAL, BST_CHECKED);
+            if (gData->flags & TEXTUREFLAGS_NOMIP) CheckDlgButton(hDlg, IDC_CHK_NOMIP, BST_CHECKED);
+            if (gData->flags & TEXTUREFLAGS_NOLOD) CheckDlgButton(hDlg, IDC_CHK_NOLOD, BST_CHECKED);
+            if (gData->flags & TEXTUREFLAGS_ALL_MIPS) CheckDlgButton(hDlg, IDC_CHK_MINMIP, BST_CHECKED);
+            if (gData->flags & TEXTUREFLAGS_PRE_SRGB) CheckDlgButton(hDlg, IDC_CHK_SRGB, BST_CHECKED);
         }
         return (INT_PTR)TRUE;
 
@@ -781,6 +1498,44 @@ static INT_PTR CALLBACK VTFOptionsDlgProc(HWND hDlg, UINT message, WPARAM wParam
 static void DoOptionsStart(void) {
     *gResult = noErr;
     
+    // Start from the sticky settings. A document opened from a VTF carries
+    // its own, which pre-fill the dialog in their place.
+    gData->exportFormat = s_lastFormat;
+    gData->flags = s_lastFlags;
+    gData->generateMipmaps = s_lastMipmaps;
+    gData->reflectivity[0] = gData->reflectivity[1] = gData->reflectivity[2] = 0.5f;
+    
+    LoadDocumentSettings();
+    
+    // Recorded or scripted settings come last; actions and batch runs with
+    // dialogs off then save without stopping
+    bool showDialog = ReadScriptParameters();
+    
+    if (showDialog) {
+        DoOptionsDialog();
+    }
+    if (*gResult != noErr) return;
+    
+    WriteScriptParameters();
+    
+    // The next save of this document reuses what was chosen now
+    VTFDocumentSettings settings;
+    settings.version = kSettingsVersion;
+    settings.format = gData->exportFormat;
+    settings.flags = gData->flags & ~kDerivedFlags;
+    settings.mipmapCount = 1;
+    settings.frames = 1;
+    for (int c = 0; c < 3; c++) {
+        settings.reflectivity[c] = gData->reflectivity[c];
+    }
+    if (gData->generateMipmaps) {
+        VPoint imageSize = GetFormatImageSize();
+        settings.mipmapCount = FullMipmapCount(imageSize.h, imageSize.v);
+    }
+    StoreDocumentSettings(settings);
+}
+
+static void DoOptionsDialog(void) {
     // Get correct module handle for the DLL
     HMODULE hModule = NULL;
     GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
@@ -835,26 +1590,37 @@ static void DoEstimateStart(void) {
     int width = imageSize.h;
     int height = imageSize.v;
     
-    // Estimate file size (header + mipmaps)
-    int32 estimate = 80; // VTF header
+    // Estimate file size (header + mipmaps). Automatic formats aren't
+    // known until the pixels are, so they span their smallest to largest.
+    VTFImageFormat minFormat = gData->exportFormat;
+    VTFImageFormat maxFormat = gData->exportFormat;
+    if (gData->exportFormat == IMAGE_FORMAT_AUTO) {
+        minFormat = IMAGE_FORMAT_DXT1;
+        maxFormat = IMAGE_FORMAT_DXT5;
+    } else if (gData->exportFormat == IMAGE_FORMAT_AUTO_LOSSLESS) {
+        minFormat = IMAGE_FORMAT_I8;
+        maxFormat = IMAGE_FORMAT_RGBA8888;
+    }
+    uint64 minEstimate = 80; // VTF header
+    uint64 maxEstimate = 80;
     
     int mipWidth = width;
     int mipHeight = height;
     
     while (mipWidth >= 1 && mipHeight >= 1) {
-        if (gData->exportFormat == IMAGE_FORMAT_DXT1) {
-            estimate += ((mipWidth + 3) / 4) * ((mipHeight + 3) / 4) * 8;
-        } else {
-            estimate += ((mipWidth + 3) / 4) * ((mipHeight + 3) / 4) * 16;
-        }
+        minEstimate += CalculateImageSize(mipWidth, mipHeight, minFormat);
+        maxEstimate += CalculateImageSize(mipWidth, mipHeight, maxFormat);
         
         if (mipWidth == 1 && mipHeight == 1) break;
         mipWidth = (mipWidth > 1) ? mipWidth / 2 : 1;
         mipHeight = (mipHeight > 1) ? mipHeight / 2 : 1;
     }
     
-    gFormatRecord->minDataBytes = estimate;
-    gFormatRecord->maxDataBytes = estimate;
+    // The host takes int32 byte counts
+    if (minEstimate > 0x7FFFFFFF) minEstimate = 0x7FFFFFFF;
+    if (maxEstimate > 0x7FFFFFFF) maxEstimate = 0x7FFFFFFF;
+    gFormatRecord->minDataBytes = static_cast<int32>(minEstimate);
+    gFormatRecord->maxDataBytes = static_cast<int32>(maxEstimate);
 }
 
 static void DoEstimateContinue(void) {
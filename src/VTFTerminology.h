@@ -0,0 +1,36 @@
+// VTF Format Plugin Scripting Terminology
+// Shared by the plugin and its resource file (VTFFormat.r), so this file
+// may only contain preprocessor definitions.
+
+#ifndef __VTFTerminology_H__
+#define __VTFTerminology_H__
+
+//-------------------------------------------------------------------------------
+//	Terminology resource
+//-------------------------------------------------------------------------------
+
+#define vtfTerminologyID	16000
+#define vtfUniqueID			"2beff80f-c8cf-435d-83c7-8d95daa282a8"
+
+//-------------------------------------------------------------------------------
+//	Save option keys
+//-------------------------------------------------------------------------------
+
+#define keyVTFFormat		'VTFf'		// enumerated, typeVTFFormat
+#define keyVTFFlags			'VTFl'		// integer, TEXTUREFLAGS_* bits
+#define keyVTFMipmaps		'VTFm'		// boolean, generate mipmaps
+
+//-------------------------------------------------------------------------------
+//	Output format enumeration
+//-------------------------------------------------------------------------------
+
+#define typeVTFFormat		'VTFt'
+
+#define enumVTFDXT1			'DXT1'
+#define enumVTFDXT5			'DXT5'
+#define enumVTFRGBA8888		'RGBA'
+#define enumVTFBGRA8888		'BGRA'
+#define enumVTFAuto			'Auto'
+#define enumVTFAutoLossless	'AutL'
+
+#endif // __VTFTerminology_H__
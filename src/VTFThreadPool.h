@@ -0,0 +1,391 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#endif
+
+// Work-stealing thread pool shared by the loader, the writer and the
+// plugin. It is created lazily on first use and lives until Shutdown(),
+// so selector calls never spawn or join threads themselves.
+//
+// Each worker owns a deque: it pops its own work from the back and steals
+// from the front of the others. Threads that are not workers submit to a
+// shared queue. A thread waiting on a TaskGroup runs queued tasks itself,
+// so tasks can start nested groups without starving the pool.
+class VTFThreadPool {
+public:
+    typedef std::function<void()> Task;
+    
+    // A set of tasks that can be waited on together
+    class TaskGroup {
+    public:
+        TaskGroup() : m_pending(0) {}
+        ~TaskGroup() { WaitNoThrow(); }
+        
+        void Run(Task task);
+        
+        // Helps run queued work until every task in the group has finished.
+        // Rethrows the first exception a task threw.
+        void Wait();
+    
+    private:
+        friend class VTFThreadPool;
+        void Finish(std::exception_ptr error);
+        void WaitNoThrow();
+        
+        std::atomic<int> m_pending;
+        std::mutex m_mutex;
+        std::condition_variable m_done;
+        std::exception_ptr m_error;
+    };
+    
+    // The shared pool, created on first use
+    static VTFThreadPool& Instance();
+    
+    // Joins all workers. The next Instance() call creates a fresh pool.
+    static void Shutdown();
+    
+    // Stops the workers from a DLL's static teardown. Windows runs that
+    // under the loader lock, and a thread can't finish exiting while it is
+    // held, so joining would deadlock. Instead each worker parks outside
+    // any lock and is then terminated, which doesn't need the loader lock.
+    // At process exit the workers are already gone. Elsewhere this is
+    // Shutdown().
+    static void ShutdownForUnload();
+    
+    // Number of worker threads used when the pool is next created;
+    // negative means one less than the hardware thread count
+    static void SetWorkerCount(int count) { RequestedWorkerCount() = count; }
+    
+    // Calls fn(begin, end) over [0, count) in chunks of at least 'grain'
+    // items, running them in parallel when that is worth it
+    static void ParallelFor(int count, int grain, const std::function<void(int, int)>& fn);
+    
+    int GetWorkerCount() const { return static_cast<int>(m_workers.size()); }
+    
+    ~VTFThreadPool();
+
+private:
+    struct Item {
+        Task task;
+        TaskGroup* group;
+    };
+    
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Item> queue;
+        std::thread thread;
+#ifdef _WIN32
+        HANDLE parked = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+        ~Worker() { CloseHandle(parked); }
+#endif
+    };
+    
+    explicit VTFThreadPool(int workerCount);
+    
+    void Push(Item item);
+    bool TryRunOne();
+    bool TryPop(Item& item);
+    void WorkerLoop(int index);
+    
+    static std::unique_ptr<VTFThreadPool>& InstancePtr();
+    static std::mutex& InstanceMutex();
+    static int& RequestedWorkerCount();
+    static int& CurrentWorkerIndex();
+    static VTFThreadPool*& CurrentPool();
+    
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    
+    // Work submitted from threads outside the pool
+    std::mutex m_sharedMutex;
+    std::deque<Item> m_shared;
+    
+    // Idle workers sleep here until work is queued
+    std::mutex m_sleepMutex;
+    std::condition_variable m_wake;
+    std::atomic<int> m_queued;
+    bool m_stop = false;
+    bool m_park = false;
+};
+
+// Implementation
+inline std::unique_ptr<VTFThreadPool>& VTFThreadPool::InstancePtr() {
+    static std::unique_ptr<VTFThreadPool> instance;
+    return instance;
+}
+
+inline std::mutex& VTFThreadPool::InstanceMutex() {
+    static std::mutex mutex;
+    return mutex;
+}
+
+inline int& VTFThreadPool::RequestedWorkerCount() {
+    static int count = -1;
+    return count;
+}
+
+inline int& VTFThreadPool::CurrentWorkerIndex() {
+    thread_local int index = -1;
+    return index;
+}
+
+inline VTFThreadPool*& VTFThreadPool::CurrentPool() {
+    thread_local VTFThreadPool* pool = nullptr;
+    return pool;
+}
+
+inline VTFThreadPool& VTFThreadPool::Instance() {
+    std::lock_guard<std::mutex> lock(InstanceMutex());
+    std::unique_ptr<VTFThreadPool>& instance = InstancePtr();
+    if (!instance) {
+        // The calling thread helps while it waits, so leave it a core
+        int workers = RequestedWorkerCount();
+        if (workers < 0) {
+            int threads = static_cast<int>(std::thread::hardware_concurrency());
+            workers = threads > 1 ? threads - 1 : 0;
+        }
+        instance.reset(new VTFThreadPool(workers));
+    }
+    return *instance;
+}
+
+inline void VTFThreadPool::Shutdown() {
+    std::unique_ptr<VTFThreadPool> instance;
+    {
+        std::lock_guard<std::mutex> lock(InstanceMutex());
+        instance = std::move(InstancePtr());
+    }
+    // Destructor joins the workers
+}
+
+inline void VTFThreadPool::ShutdownForUnload() {
+#ifdef _WIN32
+    std::unique_ptr<VTFThreadPool> instance;
+    {
+        std::lock_guard<std::mutex> lock(InstanceMutex());
+        instance = std::move(InstancePtr());
+    }
+    if (!instance) return;
+    
+    {
+        std::lock_guard<std::mutex> lock(instance->m_sleepMutex);
+        instance->m_stop = true;
+        instance->m_park = true;
+    }
+    instance->m_wake.notify_all();
+    
+    for (auto& worker : instance->m_workers) {
+        // Parked, or already ended by process exit
+        HANDLE thread = worker->thread.native_handle();
+        HANDLE waits[2] = { worker->parked, thread };
+        WaitForMultipleObjects(2, waits, FALSE, INFINITE);
+        
+        TerminateThread(thread, 0);
+        WaitForSingleObject(thread, INFINITE);
+        worker->thread.detach();
+    }
+    // Destructor has nothing left to join
+#else
+    Shutdown();
+#endif
+}
+
+inline VTFThreadPool::VTFThreadPool(int workerCount) : m_queued(0) {
+    for (int i = 0; i < workerCount; i++) {
+        m_workers.emplace_back(new Worker());
+    }
+    for (int i = 0; i < workerCount; i++) {
+        m_workers[i]->thread = std::thread(&VTFThreadPool::WorkerLoop, this, i);
+    }
+}
+
+inline VTFThreadPool::~VTFThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(m_sleepMutex);
+        m_stop = true;
+    }
+    m_wake.notify_all();
+    
+    for (auto& worker : m_workers) {
+        if (worker->thread.joinable()) worker->thread.join();
+    }
+}
+
+inline void VTFThreadPool::Push(Item item) {
+    int self = (CurrentPool() == this) ? CurrentWorkerIndex() : -1;
+    if (self >= 0) {
+        std::lock_guard<std::mutex> lock(m_workers[self]->mutex);
+        m_workers[self]->queue.push_back(std::move(item));
+    } else {
+        std::lock_guard<std::mutex> lock(m_sharedMutex);
+        m_shared.push_back(std::move(item));
+    }
+    
+    {
+        std::lock_guard<std::mutex> lock(m_sleepMutex);
+        m_queued++;
+    }
+    m_wake.notify_one();
+}
+
+inline bool VTFThreadPool::TryPop(Item& item) {
+    int self = (CurrentPool() == this) ? CurrentWorkerIndex() : -1;
+    int count = static_cast<int>(m_workers.size());
+    
+    // Own work first, newest first
+    if (self >= 0) {
+        Worker& worker = *m_workers[self];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        if (!worker.queue.empty()) {
+            item = std::move(worker.queue.back());
+            worker.queue.pop_back();
+            return true;
+        }
+    }
+    
+    // Then work submitted from outside the pool
+    {
+        std::lock_guard<std::mutex> lock(m_sharedMutex);
+        if (!m_shared.empty()) {
+            item = std::move(m_shared.front());
+            m_shared.pop_front();
+            return true;
+        }
+    }
+    
+    // Then steal the oldest work from another worker
+    for (int i = 1; i <= count; i++) {
+        int victim = (self + i + count) % count;
+        if (victim == self) continue;
+        
+        Worker& worker = *m_workers[victim];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        if (!worker.queue.empty()) {
+            item = std::move(worker.queue.front());
+            worker.queue.pop_front();
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+inline bool VTFThreadPool::TryRunOne() {
+    Item item;
+    if (!TryPop(item)) return false;
+    m_queued--;
+    
+    std::exception_ptr error;
+    try {
+        item.task();
+    } catch (...) {
+        error = std::current_exception();
+    }
+    item.group->Finish(error);
+    return true;
+}
+
+inline void VTFThreadPool::WorkerLoop(int index) {
+    CurrentWorkerIndex() = index;
+    CurrentPool() = this;
+    
+    for (;;) {
+        if (TryRunOne()) continue;
+        
+        std::unique_lock<std::mutex> lock(m_sleepMutex);
+        m_wake.wait(lock, [this]() { return m_stop || m_queued > 0; });
+        if (m_stop) break;
+    }
+    
+#ifdef _WIN32
+    if (m_park) {
+        // Wait, holding no lock, for ShutdownForUnload to end the thread
+        SetEvent(m_workers[index]->parked);
+        for (;;) Sleep(INFINITE);
+    }
+#endif
+}
+
+inline void VTFThreadPool::TaskGroup::Run(Task task) {
+    m_pending++;
+    
+    // Without workers the task stays queued until Wait() runs it
+    Item item;
+    item.task = std::move(task);
+    item.group = this;
+    Instance().Push(std::move(item));
+}
+
+inline void VTFThreadPool::TaskGroup::Finish(std::exception_ptr error) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (error && !m_error) m_error = error;
+    if (--m_pending == 0) m_done.notify_all();
+}
+
+inline void VTFThreadPool::TaskGroup::WaitNoThrow() {
+    VTFThreadPool& pool = Instance();
+    while (m_pending > 0) {
+        if (pool.TryRunOne()) continue;
+        
+        // Nothing to help with: sleep briefly, waking early when the group
+        // finishes. The timeout picks up tasks our own tasks queue later.
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_done.wait_for(lock, std::chrono::milliseconds(1), [this]() { return m_pending == 0; });
+    }
+    
+    // Finish() may still be notifying; don't let the group go away under it
+    std::lock_guard<std::mutex> lock(m_mutex);
+}
+
+inline void VTFThreadPool::TaskGroup::Wait() {
+    WaitNoThrow();
+    
+    std::exception_ptr error;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        error = m_error;
+        m_error = nullptr;
+    }
+    if (error) std::rethrow_exception(error);
+}
+
+inline void VTFThreadPool::ParallelFor(int count, int grain, const std::function<void(int, int)>& fn) {
+    if (count <= 0) return;
+    if (grain < 1) grain = 1;
+    
+    int workers = Instance().GetWorkerCount();
+    if (workers == 0 || count <= grain) {
+        fn(0, count);
+        return;
+    }
+    
+    // A few chunks per thread keeps everyone busy when chunks are uneven
+    int chunks = (count + grain - 1) / grain;
+    int maxChunks = (workers + 1) * 4;
+    if (chunks > maxChunks) chunks = maxChunks;
+    int chunkSize = (count + chunks - 1) / chunks;
+    
+    TaskGroup group;
+    for (int begin = chunkSize; begin < count; begin += chunkSize) {
+        int end = (begin + chunkSize < count) ? begin + chunkSize : count;
+        group.Run([&fn, begin, end]() { fn(begin, end); });
+    }
+    
+    // The first chunk runs on the calling thread
+    fn(0, chunkSize < count ? chunkSize : count);
+    group.Wait();
+}
@@ -0,0 +1,389 @@
+// VTF command-line tool
+//
+// Batch operations on VTF files that work on the stored data directly:
+//
+//   vtftool info <files...>
+//   vtftool stats <files...>
+//   vtftool transcode <DXT1|DXT1A|DXT3|DXT5> [--drop-alpha] <files...>
+//   vtftool mipdrop <count> <files...>
+//   vtftool flip <v|h> <files...>
+//   vtftool rotate <90|180|270> <files...>
+//   vtftool crop <x> <y> <width> <height> <files...>
+//   vtftool atlas <width> <height> -o <output> <tiles...>
+//   vtftool thumbnail <files...>
+//
+// Files are rewritten in place unless a single input is given with
+// -o <output>. 'atlas' packs all its inputs into the one output.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <fstream>
+
+#include "VTFFormat.h"
+#include "VTFAllocator.h"
+#include "VTFContainer.h"
+#include "VTFLoader.h"
+#include "VTFTransform.h"
+#include "VTFBlockCache.h"
+
+//-------------------------------------------------------------------------------
+//	Options
+//-------------------------------------------------------------------------------
+
+struct ToolOptions {
+    std::string command;
+    std::vector<std::string> args;      // Command arguments before the files
+    std::vector<std::string> files;
+    std::string output;
+    bool dropAlpha = false;
+};
+
+static void PrintUsage() {
+    fprintf(stderr,
+        "usage: vtftool <command> [options] <files...>\n"
+        "\n"
+        "commands:\n"
+        "  info                              print the header of each file\n"
+        "  stats                             print average colour, alpha use and reflectivity\n"
+        "  transcode <DXT1|DXT1A|DXT3|DXT5>  change DXT format without re-encoding\n"
+        "  mipdrop <count>                   remove the <count> largest mip levels\n"
+        "  flip <v|h>                        flip vertically or horizontally\n"
+        "  rotate <90|180|270>               rotate clockwise\n"
+        "  crop <x> <y> <width> <height>     cut out a block-aligned area\n"
+        "  atlas <width> <height>            pack the inputs into one texture (needs -o)\n"
+        "  thumbnail                         add a thumbnail to files without one\n"
+        "\n"
+        "options:\n"
+        "  -o <file>       write to <file> instead of rewriting the input\n"
+        "  --drop-alpha    let transcode discard transparency\n");
+}
+
+// Number of arguments each command takes before the file list
+static int CommandArgCount(const std::string& command) {
+    if (command == "transcode") return 1;
+    if (command == "mipdrop") return 1;
+    if (command == "flip") return 1;
+    if (command == "rotate") return 1;
+    if (command == "crop") return 4;
+    if (command == "atlas") return 2;
+    return 0;
+}
+
+static bool ParseOptions(int argc, char** argv, ToolOptions& options) {
+    if (argc < 2) return false;
+    options.command = argv[1];
+    
+    int argCount = CommandArgCount(options.command);
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            options.output = argv[++i];
+        } else if (strcmp(argv[i], "--drop-alpha") == 0) {
+            options.dropAlpha = true;
+        } else if (static_cast<int>(options.args.size()) < argCount) {
+            options.args.push_back(argv[i]);
+        } else {
+            options.files.push_back(argv[i]);
+        }
+    }
+    
+    if (static_cast<int>(options.args.size()) < argCount || options.files.empty()) return false;
+    if (options.command == "atlas") {
+        if (options.output.empty()) {
+            fprintf(stderr, "atlas needs -o <output>\n");
+            return false;
+        }
+    } else if (!options.output.empty() && options.files.size() != 1) {
+        fprintf(stderr, "-o needs a single input file\n");
+        return false;
+    }
+    return true;
+}
+
+static bool ParseFormat(const std::string& name, VTFImageFormat& format) {
+    if (name == "DXT1" || name == "dxt1") format = IMAGE_FORMAT_DXT1;
+    else if (name == "DXT1A" || name == "dxt1a") format = IMAGE_FORMAT_DXT1_ONEBITALPHA;
+    else if (name == "DXT3" || name == "dxt3") format = IMAGE_FORMAT_DXT3;
+    else if (name == "DXT5" || name == "dxt5") format = IMAGE_FORMAT_DXT5;
+    else return false;
+    return true;
+}
+
+static bool ParseInt(const std::string& text, int& value) {
+    char* end = nullptr;
+    long parsed = strtol(text.c_str(), &end, 10);
+    if (end == text.c_str() || *end != '\0') return false;
+    value = static_cast<int>(parsed);
+    return true;
+}
+
+static bool ParseOrientation(const std::string& command, const std::string& arg,
+                             VTFTransform::Orientation& orientation) {
+    if (command == "flip" && (arg == "v" || arg == "V")) orientation = VTFTransform::kFlipVertical;
+    else if (command == "flip" && (arg == "h" || arg == "H")) orientation = VTFTransform::kFlipHorizontal;
+    else if (command == "rotate" && arg == "90") orientation = VTFTransform::kRotate90;
+    else if (command == "rotate" && arg == "180") orientation = VTFTransform::kRotate180;
+    else if (command == "rotate" && arg == "270") orientation = VTFTransform::kRotate270;
+    else return false;
+    return true;
+}
+
+//-------------------------------------------------------------------------------
+//	File I/O
+//-------------------------------------------------------------------------------
+
+static bool ReadFile(const std::string& path, VTFByteVector& data) {
+    std::ifstream file(path.c_str(), std::ios::binary | std::ios::ate);
+    if (!file.is_open()) return false;
+    
+    size_t size = static_cast<size_t>(file.tellg());
+    file.seekg(0, std::ios::beg);
+    data.resize(size);
+    return static_cast<bool>(file.read(reinterpret_cast<char*>(data.data()), size));
+}
+
+static bool WriteFile(const std::string& path, const VTFByteVector& data) {
+    std::ofstream file(path.c_str(), std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) return false;
+    return static_cast<bool>(file.write(reinterpret_cast<const char*>(data.data()), data.size()));
+}
+
+//-------------------------------------------------------------------------------
+//	Commands
+//-------------------------------------------------------------------------------
+
+static void PrintInfo(const std::string& path, const VTFContainer& vtf) {
+    const VTFHeader& header = vtf.GetHeader();
+    printf("%s: VTF %u.%u, %ux%u, format %d, %d mips, %u frames, flags 0x%08x\n",
+           path.c_str(), header.version[0], header.version[1], header.width, header.height,
+           static_cast<int>(vtf.GetFormat()), vtf.GetMipmapCount(),
+           header.frames > 0 ? header.frames : 1, header.flags);
+}
+
+static bool PrintStats(const std::string& path, const VTFByteVector& data, VTFContainer& vtf) {
+    static const char* const kAlphaNames[] = { "opaque", "1-bit", "8-bit" };
+    
+    VTFLoader loader;
+    VTFImageStats stats;
+    if (!loader.Analyze(data.data(), data.size(), stats)) {
+        vtf.SetError(loader.GetError());
+        return false;
+    }
+    printf("%s: average %.3f %.3f %.3f %.3f, alpha %s, reflectivity %.3f %.3f %.3f\n", path.c_str(),
+           stats.averageColor[0], stats.averageColor[1], stats.averageColor[2], stats.averageColor[3],
+           kAlphaNames[stats.alphaClass], stats.reflectivity[0], stats.reflectivity[1], stats.reflectivity[2]);
+    return true;
+}
+
+// Applies the command to a parsed file, whose bytes are 'data'; returns
+// true if it changed it
+static bool RunCommand(const ToolOptions& options, const std::string& path, const VTFByteVector& data,
+                       VTFContainer& vtf, VTFBlockCache& cache, bool& ok) {
+    ok = true;
+    
+    if (options.command == "info") {
+        PrintInfo(path, vtf);
+        return false;
+    }
+    
+    if (options.command == "stats") {
+        ok = PrintStats(path, data, vtf);
+        return false;
+    }
+    
+    if (options.command == "transcode") {
+        VTFImageFormat format;
+        if (!ParseFormat(options.args[0], format)) {
+            vtf.SetError("Unknown format " + options.args[0]);
+            ok = false;
+            return false;
+        }
+        
+        VTFTransform::Stats stats;
+        if (!VTFTransform::Transcode(vtf, format, options.dropAlpha, &stats)) {
+            ok = false;
+            return false;
+        }
+        printf("%s: %zu blocks, %zu re-encoded\n", path.c_str(), stats.blocks, stats.lossyBlocks);
+        return true;
+    }
+    
+    if (options.command == "mipdrop") {
+        int count;
+        if (!ParseInt(options.args[0], count)) {
+            vtf.SetError("Invalid mip count " + options.args[0]);
+            ok = false;
+            return false;
+        }
+        
+        if (!VTFTransform::DropMips(vtf, count)) {
+            ok = false;
+            return false;
+        }
+        printf("%s: now %ux%u, %d mips\n", path.c_str(), vtf.GetHeader().width, vtf.GetHeader().height,
+               vtf.GetMipmapCount());
+        return count > 0;
+    }
+    
+    if (options.command == "flip" || options.command == "rotate") {
+        VTFTransform::Orientation orientation;
+        if (!ParseOrientation(options.command, options.args[0], orientation)) {
+            vtf.SetError("Invalid " + options.command + " argument " + options.args[0]);
+            ok = false;
+            return false;
+        }
+        
+        if (!VTFTransform::Reorient(vtf, orientation)) {
+            ok = false;
+            return false;
+        }
+        return true;
+    }
+    
+    if (options.command == "crop") {
+        int area[4];
+        for (int i = 0; i < 4; i++) {
+            if (!ParseInt(options.args[i], area[i])) {
+                vtf.SetError("Invalid crop value " + options.args[i]);
+                ok = false;
+                return false;
+            }
+        }
+        
+        if (!VTFTransform::Crop(vtf, area[0], area[1], area[2], area[3], &cache)) {
+            ok = false;
+            return false;
+        }
+        return true;
+    }
+    
+    if (options.command == "thumbnail") {
+        if (vtf.HasLowRes()) return false;
+        if (!VTFTransform::AddThumbnail(vtf, &cache)) {
+            ok = false;
+            return false;
+        }
+        printf("%s: added %ux%u thumbnail\n", path.c_str(), vtf.GetHeader().lowResImageWidth,
+               vtf.GetHeader().lowResImageHeight);
+        return true;
+    }
+    
+    vtf.SetError("Unknown command " + options.command);
+    ok = false;
+    return false;
+}
+
+// Packs the inputs into rows, left to right in the given order, with each
+// tile starting on a block boundary. Prints where each tile went.
+static bool RunAtlas(const ToolOptions& options, VTFBlockCache& cache) {
+    int width, height;
+    if (!ParseInt(options.args[0], width) || !ParseInt(options.args[1], height) || width < 1 || height < 1) {
+        fprintf(stderr, "Invalid atlas size %s x %s\n", options.args[0].c_str(), options.args[1].c_str());
+        return false;
+    }
+    
+    VTFByteVector data;
+    VTFContainer tile;
+    VTFContainer atlas;
+    int x = 0;
+    int y = 0;
+    int rowHeight = 0;
+    
+    for (size_t i = 0; i < options.files.size(); i++) {
+        const std::string& path = options.files[i];
+        if (!ReadFile(path, data)) {
+            fprintf(stderr, "%s: cannot read file\n", path.c_str());
+            return false;
+        }
+        if (!tile.Parse(data.data(), data.size())) {
+            fprintf(stderr, "%s: %s\n", path.c_str(), tile.GetError().c_str());
+            return false;
+        }
+        
+        // The first tile decides the format and flags
+        if (i == 0) {
+            int mipCount = tile.GetMipmapCount() > 1 ? VTFTransform::FullMipCount(width, height) : 1;
+            atlas.Create(width, height, tile.GetFormat(), mipCount);
+            atlas.GetHeader().flags = tile.GetHeader().flags;
+        }
+        
+        const VTFFormatTraits& traits = GetFormatTraits(atlas.GetFormat());
+        int tileWidth = tile.GetHeader().width;
+        int tileHeight = tile.GetHeader().height;
+        if (x + tileWidth > width) {
+            x = 0;
+            y += rowHeight;
+            rowHeight = 0;
+        }
+        
+        if (!VTFTransform::Compose(atlas, tile, x, y, &cache)) {
+            fprintf(stderr, "%s: %s\n", path.c_str(), atlas.GetError().c_str());
+            return false;
+        }
+        printf("%s: %d %d %d %d\n", path.c_str(), x, y, tileWidth, tileHeight);
+        
+        x += (tileWidth + traits.blockWidth - 1) / traits.blockWidth * traits.blockWidth;
+        int paddedHeight = (tileHeight + traits.blockHeight - 1) / traits.blockHeight * traits.blockHeight;
+        if (paddedHeight > rowHeight) rowHeight = paddedHeight;
+    }
+    
+    atlas.Serialize(data);
+    if (!WriteFile(options.output, data)) {
+        fprintf(stderr, "%s: cannot write file\n", options.output.c_str());
+        return false;
+    }
+    return true;
+}
+
+//-------------------------------------------------------------------------------
+//	Main
+//-------------------------------------------------------------------------------
+
+int main(int argc, char** argv) {
+    ToolOptions options;
+    if (!ParseOptions(argc, argv, options)) {
+        PrintUsage();
+        return 2;
+    }
+    
+    // One cache for the whole batch, so a block repeated across files is
+    // only encoded once
+    VTFBlockCache cache;
+    
+    if (options.command == "atlas") {
+        return RunAtlas(options, cache) ? 0 : 1;
+    }
+    
+    int failures = 0;
+    VTFByteVector data;
+    VTFContainer vtf;
+    
+    for (const std::string& path : options.files) {
+        if (!ReadFile(path, data)) {
+            fprintf(stderr, "%s: cannot read file\n", path.c_str());
+            failures++;
+            continue;
+        }
+        
+        bool ok = vtf.Parse(data.data(), data.size());
+        bool changed = ok && RunCommand(options, path, data, vtf, cache, ok);
+        if (!ok) {
+            fprintf(stderr, "%s: %s\n", path.c_str(), vtf.GetError().c_str());
+            failures++;
+            continue;
+        }
+        
+        if (changed) {
+            vtf.Serialize(data);
+            const std::string& target = options.output.empty() ? path : options.output;
+            if (!WriteFile(target, data)) {
+                fprintf(stderr, "%s: cannot write file\n", target.c_str());
+                failures++;
+            }
+        }
+    }
+    
+    return failures > 0 ? 1 : 0;
+}
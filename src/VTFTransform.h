@@ -0,0 +1,635 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <utility>
+#include "VTFFormat.h"
+#include "VTFContainer.h"
+#include "VTFThreadPool.h"
+#include "DXTBlocks.h"
+#include "VTFPixelConvert.h"
+
+// File-level operations that work on stored image data directly, without
+// decoding to pixels and encoding again. Each takes a parsed VTFContainer,
+// edits it in place and returns false (with the container's error set)
+// when the operation doesn't apply; the container is unchanged then.
+namespace VTFTransform {
+
+struct Stats {
+    size_t blocks = 0;              // Blocks processed
+    size_t lossyBlocks = 0;         // Blocks that had to be re-encoded
+};
+
+// Changes the format of every image between DXT1, DXT1_ONEBITALPHA, DXT3
+// and DXT5. Colour blocks are copied, alpha blocks synthesized or dropped
+// (see DXTBlocks::TranscodeBlock). Converting to plain DXT1 fails if any
+// block has transparency, unless 'dropAlpha' is set.
+inline bool Transcode(VTFContainer& vtf, VTFImageFormat format, bool dropAlpha, Stats* stats = nullptr) {
+    VTFImageFormat source = vtf.GetFormat();
+    if (!GetFormatTraits(source).compressed || !GetFormatTraits(format).compressed) {
+        vtf.SetError("Transcoding needs DXT source and target formats");
+        return false;
+    }
+    if (source == format) return true;
+    
+    // Every image is a whole number of blocks, so the image data is one
+    // run of blocks regardless of mips, frames and faces
+    const VTFByteVector& input = vtf.GetHighResData();
+    size_t srcBlockBytes = GetFormatTraits(source).bytesPerBlock;
+    size_t dstBlockBytes = GetFormatTraits(format).bytesPerBlock;
+    int blockCount = static_cast<int>(input.size() / srcBlockBytes);
+    
+    VTFByteVector output(static_cast<size_t>(blockCount) * dstBlockBytes);
+    std::atomic<size_t> lossy(0);
+    std::atomic<bool> alphaDropped(false);
+    
+    VTFThreadPool::ParallelFor(blockCount, 16384, [&](int begin, int end) {
+        size_t chunkLossy = 0;
+        bool chunkDropped = false;
+        for (int i = begin; i < end; i++) {
+            int result = DXTBlocks::TranscodeBlock(&input[i * srcBlockBytes], source,
+                                                   &output[i * dstBlockBytes], format);
+            if (result & DXTBlocks::kTranscodeLossy) chunkLossy++;
+            if (result & DXTBlocks::kTranscodeAlphaDropped) chunkDropped = true;
+        }
+        lossy += chunkLossy;
+        if (chunkDropped) alphaDropped = true;
+    });
+    
+    if (alphaDropped && !dropAlpha) {
+        vtf.SetError("Image has transparency that the target format cannot store");
+        return false;
+    }
+    
+    vtf.GetHighResData().swap(output);
+    
+    VTFHeader& header = vtf.GetHeader();
+    header.highResImageFormat = format;
+    header.flags &= ~(TEXTUREFLAGS_ONEBITALPHA | TEXTUREFLAGS_EIGHTBITALPHA);
+    header.flags |= GetFormatAlphaFlags(format);
+    
+    if (stats) {
+        stats->blocks = blockCount;
+        stats->lossyBlocks = lossy;
+    }
+    return true;
+}
+
+// Removes the 'count' largest mip levels. Levels are stored smallest
+// first, so the remaining ones are a prefix of the image data and are kept
+// byte for byte; the header takes the dimensions of the new top level. At
+// least one level must remain.
+inline bool DropMips(VTFContainer& vtf, int count) {
+    int mipCount = vtf.GetMipmapCount();
+    if (count < 0 || count >= mipCount) {
+        vtf.SetError("Cannot drop " + std::to_string(count) + " of " + std::to_string(mipCount) + " mip levels");
+        return false;
+    }
+    if (count == 0) return true;
+    
+    // The kept levels end where level count - 1 begins
+    vtf.GetHighResData().resize(vtf.GetMipOffset(count - 1));
+    
+    VTFHeader& header = vtf.GetHeader();
+    header.width = static_cast<uint16_t>(vtf.GetMipWidth(count));
+    header.height = static_cast<uint16_t>(vtf.GetMipHeight(count));
+    if (header.version[1] >= 2 && header.depth > 1) {
+        int depth = header.depth >> count;
+        header.depth = static_cast<uint16_t>(depth > 1 ? depth : 1);
+    }
+    header.mipmapCount = static_cast<uint8_t>(mipCount - count);
+    return true;
+}
+
+// Orientation changes for Reorient. Rotations are clockwise.
+enum Orientation {
+    kFlipVertical,
+    kFlipHorizontal,
+    kRotate90,
+    kRotate180,
+    kRotate270,
+};
+
+// Position in a w x h source image of pixel (x, y) of the reoriented image
+inline void SourcePixel(Orientation orientation, int x, int y, int w, int h, int& sx, int& sy) {
+    switch (orientation) {
+        case kFlipVertical:   sx = x;         sy = h - 1 - y; break;
+        case kFlipHorizontal: sx = w - 1 - x; sy = y;         break;
+        case kRotate90:       sx = y;         sy = h - 1 - x; break;
+        case kRotate180:      sx = w - 1 - x; sy = h - 1 - y; break;
+        case kRotate270:      sx = w - 1 - y; sy = x;         break;
+        default:              sx = x;         sy = y;         break;
+    }
+}
+
+inline bool SwapsDimensions(Orientation orientation) {
+    return orientation == kRotate90 || orientation == kRotate270;
+}
+
+// Reorients one w x h image. DXT images move whole blocks and remap the
+// indices inside them; that is exact when each dimension is a multiple of
+// 4 or fits in one block, which the caller checks.
+inline void ReorientImage(const uint8_t* src, uint8_t* dst, int w, int h, VTFImageFormat format,
+                          Orientation orientation) {
+    bool swap = SwapsDimensions(orientation);
+    int dstW = swap ? h : w;
+    int dstH = swap ? w : h;
+    const VTFFormatTraits& traits = GetFormatTraits(format);
+    
+    if (!traits.compressed) {
+        size_t pixelBytes = GetBytesPerPixel(format);
+        VTFThreadPool::ParallelFor(dstH, 64, [&](int begin, int end) {
+            for (int y = begin; y < end; y++) {
+                uint8_t* row = dst + static_cast<size_t>(y) * dstW * pixelBytes;
+                for (int x = 0; x < dstW; x++) {
+                    int sx, sy;
+                    SourcePixel(orientation, x, y, w, h, sx, sy);
+                    memcpy(row + x * pixelBytes, src + (static_cast<size_t>(sy) * w + sx) * pixelBytes, pixelBytes);
+                }
+            }
+        });
+        return;
+    }
+    
+    // Block grid, and the pixels used within a block (less than 4 only
+    // for images smaller than a block)
+    int blocksW = (w + 3) / 4;
+    int blocksH = (h + 3) / 4;
+    int dstBlocksW = swap ? blocksH : blocksW;
+    int dstBlocksH = swap ? blocksW : blocksH;
+    int usedW = w < 4 ? w : 4;
+    int usedH = h < 4 ? h : 4;
+    
+    // The same pixel map applies to every block; pixels outside the used
+    // area are padding and keep whatever they had
+    int map[16];
+    for (int i = 0; i < 16; i++) map[i] = i;
+    for (int y = 0; y < (swap ? usedW : usedH); y++) {
+        for (int x = 0; x < (swap ? usedH : usedW); x++) {
+            int sx, sy;
+            SourcePixel(orientation, x, y, usedW, usedH, sx, sy);
+            map[y * 4 + x] = sy * 4 + sx;
+        }
+    }
+    
+    size_t blockBytes = traits.bytesPerBlock;
+    VTFThreadPool::ParallelFor(dstBlocksH, 16, [&](int begin, int end) {
+        for (int by = begin; by < end; by++) {
+            for (int bx = 0; bx < dstBlocksW; bx++) {
+                int sbx, sby;
+                SourcePixel(orientation, bx, by, blocksW, blocksH, sbx, sby);
+                DXTBlocks::RemapBlock(src + (static_cast<size_t>(sby) * blocksW + sbx) * blockBytes,
+                                      dst + (static_cast<size_t>(by) * dstBlocksW + bx) * blockBytes,
+                                      format, map);
+            }
+        }
+    });
+}
+
+// Flips or rotates every mip level, frame, face and slice, and the
+// thumbnail, without decoding. DXT1/3/5 blocks are moved and their
+// indices remapped, so the result decodes to exactly the reoriented
+// pixels. Fails for DXT textures whose mip levels aren't block aligned.
+inline bool Reorient(VTFContainer& vtf, Orientation orientation) {
+    VTFImageFormat format = vtf.GetFormat();
+    const VTFFormatTraits& traits = GetFormatTraits(format);
+    if (traits.compressed ? traits.bytesPerBlock == 0 : GetBytesPerPixel(format) == 0) {
+        vtf.SetError("Unsupported image format");
+        return false;
+    }
+    
+    int mipCount = vtf.GetMipmapCount();
+    if (traits.compressed) {
+        for (int mip = 0; mip < mipCount; mip++) {
+            int w = vtf.GetMipWidth(mip);
+            int h = vtf.GetMipHeight(mip);
+            if ((w > 4 && w % 4 != 0) || (h > 4 && h % 4 != 0)) {
+                vtf.SetError("Mip dimensions are not a multiple of the DXT block size");
+                return false;
+            }
+        }
+    }
+    
+    // The thumbnail is DXT1 in practice; leave it alone if it can't be
+    // reoriented exactly
+    VTFHeader& header = vtf.GetHeader();
+    VTFImageFormat lowResFormat = static_cast<VTFImageFormat>(header.lowResImageFormat);
+    int lowResW = header.lowResImageWidth;
+    int lowResH = header.lowResImageHeight;
+    bool lowResAligned = GetFormatTraits(lowResFormat).compressed
+                       ? (lowResW <= 4 || lowResW % 4 == 0) && (lowResH <= 4 || lowResH % 4 == 0)
+                       : GetBytesPerPixel(lowResFormat) > 0;
+    
+    const VTFByteVector& input = vtf.GetHighResData();
+    VTFByteVector output(input.size());
+    for (int mip = 0; mip < mipCount; mip++) {
+        int w = vtf.GetMipWidth(mip);
+        int h = vtf.GetMipHeight(mip);
+        size_t imageSize = CalculateImageSize(w, h, format);
+        size_t offset = vtf.GetMipOffset(mip);
+        
+        for (int image = 0; image < vtf.GetImageCount(mip); image++) {
+            size_t at = offset + image * imageSize;
+            ReorientImage(&input[at], &output[at], w, h, format, orientation);
+        }
+    }
+    vtf.GetHighResData().swap(output);
+    
+    if (!vtf.GetLowResData().empty() && lowResAligned) {
+        VTFByteVector lowRes(vtf.GetLowResData().size());
+        ReorientImage(vtf.GetLowResData().data(), lowRes.data(), lowResW, lowResH, lowResFormat, orientation);
+        vtf.GetLowResData().swap(lowRes);
+    }
+    
+    if (SwapsDimensions(orientation)) {
+        std::swap(header.width, header.height);
+        if (!vtf.GetLowResData().empty() && lowResAligned) {
+            std::swap(header.lowResImageWidth, header.lowResImageHeight);
+        }
+    }
+    return true;
+}
+
+// Number of mip levels down to 1x1
+inline int FullMipCount(int width, int height) {
+    int count = 1;
+    while (width > 1 || height > 1) {
+        width = (width > 1) ? width / 2 : 1;
+        height = (height > 1) ? height / 2 : 1;
+        count++;
+    }
+    return count;
+}
+
+// Start of one image (frame, face or slice) of a mip level
+inline const uint8_t* ImageData(const VTFContainer& vtf, int mip, int image) {
+    size_t imageSize = CalculateImageSize(vtf.GetMipWidth(mip), vtf.GetMipHeight(mip), vtf.GetFormat());
+    return &vtf.GetHighResData()[vtf.GetMipOffset(mip) + image * imageSize];
+}
+
+inline uint8_t* ImageData(VTFContainer& vtf, int mip, int image) {
+    return const_cast<uint8_t*>(ImageData(static_cast<const VTFContainer&>(vtf), mip, image));
+}
+
+// Whether areas of a format can be decoded and encoded again, which
+// levels that can't be copied need
+inline bool CanReencode(VTFImageFormat format) {
+    if (GetFormatTraits(format).compressed) return true;
+    
+    uint8_t pixel[4] = {};
+    uint8_t stored[16];
+    return VTFConvertToFormat<VTFLayout::RGBA8888>(format, pixel, stored, 1);
+}
+
+// Decodes the w x h area at block-aligned (x, y) of an image to RGBA
+inline void DecodeArea(const VTFContainer& vtf, int mip, int image, int x, int y, int w, int h, uint8_t* rgba) {
+    VTFImageFormat format = vtf.GetFormat();
+    const VTFFormatTraits& traits = GetFormatTraits(format);
+    const uint8_t* data = ImageData(vtf, mip, image);
+    int mipWidth = vtf.GetMipWidth(mip);
+    
+    if (!traits.compressed) {
+        for (int row = 0; row < h; row++) {
+            const uint8_t* src = data + (static_cast<size_t>(y + row) * mipWidth + x) * traits.bytesPerBlock;
+            VTFConvertFromFormat<VTFLayout::RGBA8888>(format, src, rgba + static_cast<size_t>(row) * w * 4, w);
+        }
+        return;
+    }
+    
+    // Gather the area's blocks into a small image of their own
+    int rowBlocks = (mipWidth + 3) / 4;
+    int blocksW = (w + 3) / 4;
+    int blocksH = (h + 3) / 4;
+    size_t rowBytes = static_cast<size_t>(blocksW) * traits.bytesPerBlock;
+    std::vector<uint8_t> blocks(rowBytes * blocksH);
+    for (int by = 0; by < blocksH; by++) {
+        size_t offset = (static_cast<size_t>(y / 4 + by) * rowBlocks + x / 4) * traits.bytesPerBlock;
+        memcpy(&blocks[by * rowBytes], data + offset, rowBytes);
+    }
+    DXT::DecompressDXT(blocks.data(), rgba, w, h, format);
+}
+
+// Encodes RGBA pixels into the w x h area at block-aligned (x, y). DXT
+// blocks go through 'cache' when one is given.
+inline void EncodeArea(VTFContainer& vtf, int mip, int image, int x, int y, int w, int h, const uint8_t* rgba,
+                       VTFBlockCache* cache = nullptr) {
+    VTFImageFormat format = vtf.GetFormat();
+    const VTFFormatTraits& traits = GetFormatTraits(format);
+    uint8_t* data = ImageData(vtf, mip, image);
+    int mipWidth = vtf.GetMipWidth(mip);
+    
+    if (!traits.compressed) {
+        for (int row = 0; row < h; row++) {
+            uint8_t* dst = data + (static_cast<size_t>(y + row) * mipWidth + x) * traits.bytesPerBlock;
+            VTFConvertToFormat<VTFLayout::RGBA8888>(format, rgba + static_cast<size_t>(row) * w * 4, dst, w);
+        }
+        return;
+    }
+    
+    int rowBlocks = (mipWidth + 3) / 4;
+    int blocksW = (w + 3) / 4;
+    int blocksH = (h + 3) / 4;
+    for (int by = 0; by < blocksH; by++) {
+        for (int bx = 0; bx < blocksW; bx++) {
+            uint8_t block[64];
+            DXTCompress::GatherBlock(rgba, w, h, bx, by, block);
+            size_t offset = (static_cast<size_t>(y / 4 + by) * rowBlocks + x / 4 + bx) * traits.bytesPerBlock;
+            DXTBlocks::EncodeBlock(block, format, data + offset, cache);
+        }
+    }
+}
+
+// Halves an RGBA image with the writer's 2x2 box filter; a last odd row
+// or column averages the pixels it has
+inline void DownsampleRGBA(const uint8_t* src, int srcW, int srcH, uint8_t* dst, int w, int h) {
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            for (int c = 0; c < 4; c++) {
+                int sum = 0;
+                int count = 0;
+                for (int dy = 0; dy < 2 && y * 2 + dy < srcH; dy++) {
+                    for (int dx = 0; dx < 2 && x * 2 + dx < srcW; dx++) {
+                        sum += src[(static_cast<size_t>(y * 2 + dy) * srcW + x * 2 + dx) * 4 + c];
+                        count++;
+                    }
+                }
+                dst[(static_cast<size_t>(y) * w + x) * 4 + c] = static_cast<uint8_t>(sum / count);
+            }
+        }
+    }
+}
+
+// Rebuilds the area [x0, x1) x [y0, y1) of a mip level from the level
+// above with the writer's 2x2 box filter. The area is widened to whole
+// blocks first.
+inline void RegenerateArea(VTFContainer& vtf, int mip, int x0, int y0, int x1, int y1,
+                           VTFBlockCache* cache = nullptr) {
+    const VTFFormatTraits& traits = GetFormatTraits(vtf.GetFormat());
+    int mipWidth = vtf.GetMipWidth(mip);
+    int mipHeight = vtf.GetMipHeight(mip);
+    x0 -= x0 % traits.blockWidth;
+    y0 -= y0 % traits.blockHeight;
+    x1 = (x1 + traits.blockWidth - 1) / traits.blockWidth * traits.blockWidth;
+    y1 = (y1 + traits.blockHeight - 1) / traits.blockHeight * traits.blockHeight;
+    if (x1 > mipWidth) x1 = mipWidth;
+    if (y1 > mipHeight) y1 = mipHeight;
+    
+    // Matching area of the level above
+    int srcX1 = (x1 * 2 < vtf.GetMipWidth(mip - 1)) ? x1 * 2 : vtf.GetMipWidth(mip - 1);
+    int srcY1 = (y1 * 2 < vtf.GetMipHeight(mip - 1)) ? y1 * 2 : vtf.GetMipHeight(mip - 1);
+    int srcW = srcX1 - x0 * 2;
+    int srcH = srcY1 - y0 * 2;
+    int w = x1 - x0;
+    int h = y1 - y0;
+    
+    std::vector<uint8_t> above(static_cast<size_t>(srcW) * srcH * 4);
+    std::vector<uint8_t> area(static_cast<size_t>(w) * h * 4);
+    for (int image = 0; image < vtf.GetImageCount(mip); image++) {
+        DecodeArea(vtf, mip - 1, image, x0 * 2, y0 * 2, srcW, srcH, above.data());
+        DownsampleRGBA(above.data(), srcW, srcH, area.data(), w, h);
+        EncodeArea(vtf, mip, image, x0, y0, w, h, area.data(), cache);
+    }
+}
+
+// Whether level 'mip' of a w x h area can be copied block for block from
+// (sx, sy) in 'src' to (dx, dy) in 'dst': the area scales down exactly,
+// starts on a block boundary in both and ends on one or at both edges.
+inline bool CanCopyLevel(const VTFContainer& src, int sx, int sy, const VTFContainer& dst, int dx, int dy,
+                         int w, int h, int mip) {
+    if (mip >= src.GetMipmapCount() || mip >= dst.GetMipmapCount()) return false;
+    if ((sx | sy | dx | dy | w | h) & ((1 << mip) - 1)) return false;
+    
+    sx >>= mip;
+    sy >>= mip;
+    dx >>= mip;
+    dy >>= mip;
+    w >>= mip;
+    h >>= mip;
+    
+    const VTFFormatTraits& traits = GetFormatTraits(dst.GetFormat());
+    if (sx % traits.blockWidth || dx % traits.blockWidth) return false;
+    if (sy % traits.blockHeight || dy % traits.blockHeight) return false;
+    
+    bool fitsW = (w % traits.blockWidth == 0) ||
+                 (sx + w == src.GetMipWidth(mip) && dx + w == dst.GetMipWidth(mip));
+    bool fitsH = (h % traits.blockHeight == 0) ||
+                 (sy + h == src.GetMipHeight(mip) && dy + h == dst.GetMipHeight(mip));
+    return fitsW && fitsH;
+}
+
+// Copies the stored blocks of a level; positions are block aligned
+inline void CopyLevel(const VTFContainer& src, int sx, int sy, VTFContainer& dst, int dx, int dy,
+                      int w, int h, int mip) {
+    const VTFFormatTraits& traits = GetFormatTraits(dst.GetFormat());
+    int srcRowBlocks = (src.GetMipWidth(mip) + traits.blockWidth - 1) / traits.blockWidth;
+    int dstRowBlocks = (dst.GetMipWidth(mip) + traits.blockWidth - 1) / traits.blockWidth;
+    int blocksW = (w + traits.blockWidth - 1) / traits.blockWidth;
+    int blocksH = (h + traits.blockHeight - 1) / traits.blockHeight;
+    size_t rowBytes = static_cast<size_t>(blocksW) * traits.bytesPerBlock;
+    
+    for (int image = 0; image < dst.GetImageCount(mip); image++) {
+        const uint8_t* srcData = ImageData(src, mip, image);
+        uint8_t* dstData = ImageData(dst, mip, image);
+        for (int by = 0; by < blocksH; by++) {
+            size_t srcOffset = static_cast<size_t>(sy / traits.blockHeight + by) * srcRowBlocks + sx / traits.blockWidth;
+            size_t dstOffset = static_cast<size_t>(dy / traits.blockHeight + by) * dstRowBlocks + dx / traits.blockWidth;
+            memcpy(dstData + dstOffset * traits.bytesPerBlock, srcData + srcOffset * traits.bytesPerBlock, rowBytes);
+        }
+    }
+}
+
+// Copies the w x h area at (sx, sy) of 'src' to (dx, dy) in 'dst', which
+// must have the same format and images per level, and brings the smaller
+// levels of 'dst' up to date. Levels where the area stays block aligned
+// are copied as stored; the others are rebuilt from the level above, over
+// just the area that changed. Fails (with the error set on 'dst') if the
+// area isn't block aligned at full size. Rebuilt blocks are encoded
+// through 'cache' when one is given.
+inline bool CopyRegion(const VTFContainer& src, int sx, int sy, VTFContainer& dst, int dx, int dy, int w, int h,
+                       VTFBlockCache* cache = nullptr) {
+    if (GetDepth(dst.GetHeader()) > 1) {
+        dst.SetError("Volume textures are not supported");
+        return false;
+    }
+    if (!CanCopyLevel(src, sx, sy, dst, dx, dy, w, h, 0)) {
+        dst.SetError("Area is not aligned to the format's blocks");
+        return false;
+    }
+    
+    int mipCount = dst.GetMipmapCount();
+    std::vector<bool> copy(mipCount);
+    bool rebuild = false;
+    for (int mip = 0; mip < mipCount; mip++) {
+        copy[mip] = CanCopyLevel(src, sx, sy, dst, dx, dy, w, h, mip);
+        if (!copy[mip]) rebuild = true;
+    }
+    if (rebuild && !CanReencode(dst.GetFormat())) {
+        dst.SetError("Mip levels of this format can't be rebuilt; the area must stay aligned on every level");
+        return false;
+    }
+    
+    // The area of the current level that changed
+    int x0 = dx;
+    int y0 = dy;
+    int x1 = dx + w;
+    int y1 = dy + h;
+    CopyLevel(src, sx, sy, dst, dx, dy, w, h, 0);
+    
+    for (int mip = 1; mip < mipCount; mip++) {
+        x0 /= 2;
+        y0 /= 2;
+        x1 = (x1 + 1) / 2;
+        y1 = (y1 + 1) / 2;
+        if (x1 > dst.GetMipWidth(mip)) x1 = dst.GetMipWidth(mip);
+        if (y1 > dst.GetMipHeight(mip)) y1 = dst.GetMipHeight(mip);
+        
+        if (copy[mip]) {
+            CopyLevel(src, sx >> mip, sy >> mip, dst, dx >> mip, dy >> mip, w >> mip, h >> mip, mip);
+        } else {
+            RegenerateArea(dst, mip, x0, y0, x1, y1, cache);
+        }
+    }
+    return true;
+}
+
+// Cuts out the width x height area at (x, y). The area must start on a
+// block boundary and end on one or at the image edge. Mip levels are
+// copied where the area stays aligned and rebuilt from the level above
+// where it doesn't; the thumbnail, which shows the whole image, is
+// removed.
+inline bool Crop(VTFContainer& vtf, int x, int y, int width, int height, VTFBlockCache* cache = nullptr) {
+    const VTFHeader& header = vtf.GetHeader();
+    if (width < 1 || height < 1 || x < 0 || y < 0 || x + width > header.width || y + height > header.height) {
+        vtf.SetError("Crop area is outside the image");
+        return false;
+    }
+    
+    VTFContainer cropped = vtf;
+    cropped.ClearLowRes();
+    cropped.ResizeImage(width, height, vtf.GetMipmapCount() > 1 ? FullMipCount(width, height) : 1);
+    if (!CopyRegion(vtf, x, y, cropped, 0, 0, width, height, cache)) {
+        vtf.SetError(cropped.GetError());
+        return false;
+    }
+    
+    vtf = std::move(cropped);
+    return true;
+}
+
+// Places 'tile' at (x, y) in 'atlas', which must have the same format,
+// frame count and face count. The position must be block aligned and the
+// tile a whole number of blocks unless it ends at the atlas edge. The
+// atlas's thumbnail is removed since it no longer matches.
+inline bool Compose(VTFContainer& atlas, const VTFContainer& tile, int x, int y, VTFBlockCache* cache = nullptr) {
+    const VTFHeader& atlasHeader = atlas.GetHeader();
+    const VTFHeader& tileHeader = tile.GetHeader();
+    if (tile.GetFormat() != atlas.GetFormat()) {
+        atlas.SetError("Tile format differs from the atlas format");
+        return false;
+    }
+    if (tile.GetImageCount(0) != atlas.GetImageCount(0) || GetFaceCount(tileHeader) != GetFaceCount(atlasHeader)) {
+        atlas.SetError("Tile frames or faces differ from the atlas");
+        return false;
+    }
+    if (x < 0 || y < 0 || x + tileHeader.width > atlasHeader.width || y + tileHeader.height > atlasHeader.height) {
+        atlas.SetError("Tile does not fit in the atlas");
+        return false;
+    }
+    
+    if (!CopyRegion(tile, 0, 0, atlas, x, y, tileHeader.width, tileHeader.height, cache)) return false;
+    atlas.ClearLowRes();
+    return true;
+}
+
+// Builds an RGBA preview of the first image, at most maxSize pixels on
+// either side. DXT images start from the smallest mip level whose block
+// averages (DXT::AverageBlock) reach maxSize, a quarter-scale image
+// that needs no decoding; other formats, or images too small for that,
+// start from the smallest level that reaches maxSize. The result is then
+// halved until it fits. Returns false for formats that can't be decoded.
+inline bool MakePreview(const VTFContainer& vtf, int maxSize, std::vector<uint8_t>& rgba, int& width, int& height) {
+    VTFImageFormat format = vtf.GetFormat();
+    const VTFFormatTraits& traits = GetFormatTraits(format);
+    if (!CanReencode(format)) return false;
+    if (maxSize < 1) maxSize = 1;
+    
+    auto largest = [](int w, int h) { return w > h ? w : h; };
+    int mipCount = vtf.GetMipmapCount();
+    
+    int blockMip = -1;
+    if (traits.compressed) {
+        for (int mip = mipCount - 1; mip >= 0; mip--) {
+            if (largest((vtf.GetMipWidth(mip) + 3) / 4, (vtf.GetMipHeight(mip) + 3) / 4) >= maxSize) {
+                blockMip = mip;
+                break;
+            }
+        }
+    }
+    
+    if (blockMip >= 0) {
+        width = (vtf.GetMipWidth(blockMip) + 3) / 4;
+        height = (vtf.GetMipHeight(blockMip) + 3) / 4;
+        rgba.resize(static_cast<size_t>(width) * height * 4);
+        const uint8_t* blocks = ImageData(vtf, blockMip, 0);
+        for (size_t i = 0; i < static_cast<size_t>(width) * height; i++) {
+            DXT::AverageBlock(blocks + i * traits.bytesPerBlock, format, &rgba[i * 4]);
+        }
+    } else {
+        int mip = 0;
+        for (int level = mipCount - 1; level >= 0; level--) {
+            if (largest(vtf.GetMipWidth(level), vtf.GetMipHeight(level)) >= maxSize) {
+                mip = level;
+                break;
+            }
+        }
+        width = vtf.GetMipWidth(mip);
+        height = vtf.GetMipHeight(mip);
+        rgba.resize(static_cast<size_t>(width) * height * 4);
+        DecodeArea(vtf, mip, 0, 0, 0, width, height, rgba.data());
+    }
+    
+    std::vector<uint8_t> half;
+    while (largest(width, height) > maxSize) {
+        int w = width > 1 ? width / 2 : 1;
+        int h = height > 1 ? height / 2 : 1;
+        half.resize(static_cast<size_t>(w) * h * 4);
+        DownsampleRGBA(rgba.data(), width, height, half.data(), w, h);
+        rgba.swap(half);
+        width = w;
+        height = h;
+    }
+    return true;
+}
+
+// Gives a texture without a thumbnail the usual DXT1 one, at most 16
+// pixels on either side, built by MakePreview. Textures that have one are
+// left alone. Blocks are encoded through 'cache' when one is given.
+inline bool AddThumbnail(VTFContainer& vtf, VTFBlockCache* cache = nullptr) {
+    if (vtf.HasLowRes()) return true;
+    
+    std::vector<uint8_t> rgba;
+    int width, height;
+    if (!MakePreview(vtf, 16, rgba, width, height)) {
+        vtf.SetError("Cannot build a preview of this image format");
+        return false;
+    }
+    
+    int blocksW = (width + 3) / 4;
+    int blocksH = (height + 3) / 4;
+    VTFByteVector thumbnail(CalculateImageSize(width, height, IMAGE_FORMAT_DXT1));
+    for (int by = 0; by < blocksH; by++) {
+        for (int bx = 0; bx < blocksW; bx++) {
+            uint8_t block[64];
+            DXTCompress::GatherBlock(rgba.data(), width, height, bx, by, block);
+            DXTBlocks::EncodeBlock(block, IMAGE_FORMAT_DXT1, &thumbnail[(static_cast<size_t>(by) * blocksW + bx) * 8], cache);
+        }
+    }
+    
+    vtf.SetLowRes(IMAGE_FORMAT_DXT1, width, height, std::move(thumbnail));
+    return true;
+}
+
+} // namespace VTFTransform
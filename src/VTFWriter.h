@@ -1,10 +1,20 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
+#include <climits>
+#include <cstdlib>
 #include <vector>
 #include <string>
 #include <fstream>
+#include <functional>
+#include <utility>
 #include "VTFFormat.h"
+#include "VTFAllocator.h"
+#include "VTFThreadPool.h"
+#include "VTFHash.h"
+#include "VTFBlockCache.h"
+#include "VTFPixelConvert.h"
 
 // DXT Compression (simplified - for production, consider using a library like stb_dxt)
 namespace DXTCompress {
@@ -73,8 +83,77 @@ inline void CompressDXT1Block(const uint8_t* rgba, uint8_t* output) {
     *reinterpret_cast<uint32_t*>(output + 4) = indices;
 }
 
-// Compress a 4x4 block to DXT5 (with alpha)
-inline void CompressDXT5Block(const uint8_t* rgba, uint8_t* output) {
+// Compress a 4x4 block to DXT1 with one-bit alpha. Blocks with a pixel
+// below alpha 128 use three-colour mode (color0 <= color1), where index 3
+// is transparent black; fully opaque blocks are plain DXT1 blocks.
+inline void CompressDXT1ABlock(const uint8_t* rgba, uint8_t* output) {
+    // Find min/max colors of the opaque pixels
+    uint8_t minColor[3] = {255, 255, 255};
+    uint8_t maxColor[3] = {0, 0, 0};
+    bool transparent = false;
+    bool opaque = false;
+    
+    for (int i = 0; i < 16; i++) {
+        if (rgba[i*4 + 3] < 128) {
+            transparent = true;
+            continue;
+        }
+        opaque = true;
+        for (int c = 0; c < 3; c++) {
+            if (rgba[i*4 + c] < minColor[c]) minColor[c] = rgba[i*4 + c];
+            if (rgba[i*4 + c] > maxColor[c]) maxColor[c] = rgba[i*4 + c];
+        }
+    }
+    
+    if (!transparent) {
+        CompressDXT1Block(rgba, output);
+        return;
+    }
+    if (!opaque) {
+        memset(output, 0, 4);
+        memset(output + 4, 0xFF, 4);
+        return;
+    }
+    
+    // Every channel of the minimum is <= the maximum, so its 565 value is
+    // too, which selects three-colour mode
+    uint16_t color0 = ((minColor[0] >> 3) << 11) | ((minColor[1] >> 2) << 5) | (minColor[2] >> 3);
+    uint16_t color1 = ((maxColor[0] >> 3) << 11) | ((maxColor[1] >> 2) << 5) | (maxColor[2] >> 3);
+    *reinterpret_cast<uint16_t*>(output) = color0;
+    *reinterpret_cast<uint16_t*>(output + 2) = color1;
+    
+    uint8_t palette[3][3];
+    for (int c = 0; c < 3; c++) {
+        palette[0][c] = minColor[c];
+        palette[1][c] = maxColor[c];
+        palette[2][c] = (minColor[c] + maxColor[c]) / 2;
+    }
+    
+    uint32_t indices = 0;
+    for (int i = 0; i < 16; i++) {
+        int bestIdx = 3;
+        if (rgba[i*4 + 3] >= 128) {
+            int bestDist = INT_MAX;
+            for (int j = 0; j < 3; j++) {
+                int dist = 0;
+                for (int c = 0; c < 3; c++) {
+                    int diff = rgba[i*4 + c] - palette[j][c];
+                    dist += diff * diff;
+                }
+                if (dist < bestDist) {
+                    bestDist = dist;
+                    bestIdx = j;
+                }
+            }
+        }
+        indices |= (bestIdx << (i * 2));
+    }
+    
+    *reinterpret_cast<uint32_t*>(output + 4) = indices;
+}
+
+// Compress the alpha of a 4x4 block to a DXT5 alpha block (8 bytes)
+inline void CompressDXT5Alpha(const uint8_t* rgba, uint8_t* output) {
     // Find min/max alpha
     uint8_t minAlpha = 255, maxAlpha = 0;
     for (int i = 0; i < 16; i++) {
@@ -123,11 +202,44 @@ inline void CompressDXT5Block(const uint8_t* rgba, uint8_t* output) {
     for (int i = 0; i < 6; i++) {
         output[2 + i] = (alphaIndices >> (i * 8)) & 0xFF;
     }
+}
+
+// Compress a 4x4 block to DXT5 (with alpha)
+inline void CompressDXT5Block(const uint8_t* rgba, uint8_t* output) {
+    CompressDXT5Alpha(rgba, output);
     
     // Compress color part (same as DXT1)
     CompressDXT1Block(rgba, output + 8);
 }
 
+// Gathers the 4x4 block (bx, by) of an RGBA image into 'block'. Full
+// blocks are four 16-byte row copies. Blocks past the right or bottom edge
+// replicate the nearest edge pixels; the copies repeat real pixels, so
+// they cannot widen the min/max endpoint fit. That masks them out of the
+// fit instead of pulling edge endpoints toward black.
+inline void GatherBlock(const uint8_t* rgba, int width, int height, int bx, int by, uint8_t* block) {
+    int x0 = bx * 4;
+    int y0 = by * 4;
+    size_t pitch = static_cast<size_t>(width) * 4;
+    
+    if (x0 + 4 <= width && y0 + 4 <= height) {
+        const uint8_t* src = rgba + y0 * pitch + x0 * 4;
+        memcpy(block, src, 16);
+        memcpy(block + 16, src + pitch, 16);
+        memcpy(block + 32, src + pitch * 2, 16);
+        memcpy(block + 48, src + pitch * 3, 16);
+        return;
+    }
+    
+    for (int y = 0; y < 4; y++) {
+        int srcY = (y0 + y < height) ? y0 + y : height - 1;
+        for (int x = 0; x < 4; x++) {
+            int srcX = (x0 + x < width) ? x0 + x : width - 1;
+            memcpy(&block[(y * 4 + x) * 4], &rgba[srcY * pitch + srcX * 4], 4);
+        }
+    }
+}
+
 } // namespace DXTCompress
 
 class VTFWriter {
@@ -138,8 +250,21 @@ public:
     // Set image data (RGBA format, 8 bits per channel)
     void SetImageData(const uint8_t* rgba, int width, int height, bool hasAlpha);
     
-    // Set output format
-    void SetFormat(VTFImageFormat format) { m_format = format; }
+    // Sizes the source buffer and returns it for the caller to fill with
+    // RGBA pixels, avoiding a staging copy
+    uint8_t* PrepareImageData(int width, int height, bool hasAlpha);
+    
+    // Set output format. IMAGE_FORMAT_AUTO classifies the alpha of the
+    // image when it is written: opaque images become DXT1, ones with only
+    // 0 and 255 DXT1_ONEBITALPHA and the rest DXT5. IMAGE_FORMAT_AUTO_LOSSLESS
+    // picks the smallest exact uncompressed format: I8 or IA88 when R, G
+    // and B are equal everywhere, RGB888 or RGBA8888 otherwise, with alpha
+    // only when some pixel isn't opaque. In both modes the alpha flags of
+    // the header follow the image.
+    void SetFormat(VTFImageFormat format);
+    
+    // Format of the written file, once automatic selection has run
+    VTFImageFormat GetFormat() const { return m_format; }
     
     // Set flags
     void SetFlags(uint32_t flags) { m_flags = flags; }
@@ -147,6 +272,13 @@ public:
     // Generate mipmaps
     void SetGenerateMipmaps(bool generate) { m_generateMipmaps = generate; }
     
+    // Average color stored in the header for radiosity
+    void SetReflectivity(float r, float g, float b) {
+        m_reflectivity[0] = r;
+        m_reflectivity[1] = g;
+        m_reflectivity[2] = b;
+    }
+    
     // Write to file
     bool Write(const char* filename);
     bool Write(const wchar_t* filename);
@@ -154,28 +286,85 @@ public:
     // Write to memory buffer
     bool WriteToMemory(std::vector<uint8_t>& output);
     
+    // Write as an ordered list of segments: the header, then each mip
+    // (smallest first) in bands of rows. Each segment is handed to the
+    // sink as soon as it is encoded and is only valid during the call.
+    // Returning false from the sink aborts the write.
+    typedef std::function<bool(const uint8_t* data, size_t size)> SegmentSink;
+    bool WriteSegments(const SegmentSink& sink);
+    
+    // Size of the file WriteSegments() will produce
+    size_t CalculateFileSize();
+    
+    // Incremental mode keeps a hash of every 4x4 source block, the mips and
+    // the encoded output of the previous write. The next write re-encodes
+    // only blocks whose pixels changed, plus the mip regions above them.
+    void SetIncremental(bool incremental);
+    
+    // Blocks (over all mips) encoded by the last write
+    size_t GetEncodedBlockCount() const { return m_encodedBlockCount; }
+    
+    // Optional cache of encoded DXT blocks, shared with other writers;
+    // nullptr (the default) encodes every block
+    void SetBlockCache(VTFBlockCache* cache) { m_blockCache = cache; }
+    
     // Get error
     const std::string& GetError() const { return m_error; }
     
+    // Frees source, mip and scratch buffers larger than maxBytes. Smaller
+    // ones are kept so a reused writer encodes without reallocating.
+    void Trim(size_t maxBytes);
+    
 private:
+    void ResolveFormat();
+    VTFAlphaClass ClassifyAlpha() const;
+    bool IsGrayscale() const;
     void GenerateMipmaps();
-    void CompressImage(const uint8_t* rgba, int width, int height, std::vector<uint8_t>& output);
+    void DownsampleRect(int mip, int x0, int y0, int x1, int y1);
+    void CompressImage(const uint8_t* rgba, int width, int height, VTFByteVector& output);
+    void EncodeBlock(const uint8_t* rgba, int width, int height, int bx, int by, uint8_t* output);
+    bool UpdateIncremental(const SegmentSink& sink);
     void ConvertFromRGBA(const uint8_t* rgba, uint8_t* dst, int width, int height);
-    int CalculateMipmapCount(int width, int height);
+    int CalculateMipmapCount(int width, int height) const;
+    void BuildHeader(VTFHeader& header) const;
+    const uint8_t* GetMipData(int mip) const;
     
     // Source image
-    std::vector<uint8_t> m_sourceRGBA;
+    VTFByteVector m_sourceRGBA;
     int m_width = 0;
     int m_height = 0;
     bool m_hasAlpha = false;
     
-    // Mipmaps (including original)
-    std::vector<std::vector<uint8_t>> m_mipmaps;
+    // Downscaled mipmaps; entry i holds mip i + 1, mip 0 is the source.
+    // Entries are resized in place so repeated writes reuse them.
+    std::vector<VTFByteVector> m_mipmaps;
+    int m_mipCount = 0;
+    
+    // Encoded band handed to the segment sink
+    VTFByteVector m_compressed;
+    
+    // Incremental state: layout of the previous write, hashes of its 4x4
+    // source blocks and its encoded mips
+    bool m_incremental = false;
+    bool m_incrementalValid = false;
+    int m_prevWidth = 0;
+    int m_prevHeight = 0;
+    int m_prevMipCount = 0;
+    VTFImageFormat m_prevFormat = IMAGE_FORMAT_NONE;
+    std::vector<uint64_t> m_blockHashes;
+    std::vector<VTFByteVector> m_encodedMips;
+    size_t m_encodedBlockCount = 0;
+    
+    VTFBlockCache* m_blockCache = nullptr;
     
     // Output settings
     VTFImageFormat m_format = IMAGE_FORMAT_DXT5;
+    VTFImageFormat m_autoFormat = IMAGE_FORMAT_NONE;
+    bool m_formatResolved = false;
+    VTFAlphaClass m_alphaClass = ALPHA_CLASS_OPAQUE;
     uint32_t m_flags = TEXTUREFLAGS_NORMAL;
     bool m_generateMipmaps = true;
+    float m_reflectivity[3] = {0.5f, 0.5f, 0.5f};
     
     std::string m_error;
 };
@@ -184,14 +373,19 @@ private:
 inline VTFWriter::VTFWriter() {}
 inline VTFWriter::~VTFWriter() {}
 
-inline void VTFWriter::SetImageData(const uint8_t* rgba, int width, int height, bool hasAlpha) {
+inline uint8_t* VTFWriter::PrepareImageData(int width, int height, bool hasAlpha) {
     m_width = width;
     m_height = height;
     m_hasAlpha = hasAlpha;
+    m_formatResolved = false;
     
-    size_t size = width * height * 4;
-    m_sourceRGBA.resize(size);
-    memcpy(m_sourceRGBA.data(), rgba, size);
+    m_sourceRGBA.resize(static_cast<size_t>(width) * height * 4);
+    return m_sourceRGBA.data();
+}
+
+inline void VTFWriter::SetImageData(const uint8_t* rgba, int width, int height, bool hasAlpha) {
+    uint8_t* dst = PrepareImageData(width, height, hasAlpha);
+    memcpy(dst, rgba, m_sourceRGBA.size());
     
     // Auto-select format based on alpha
     if (!hasAlpha && m_format == IMAGE_FORMAT_DXT5) {
@@ -199,7 +393,71 @@ inline void VTFWriter::SetImageData(const uint8_t* rgba, int width, int height,
     }
 }
 
-inline int VTFWriter::CalculateMipmapCount(int width, int height) {
+inline void VTFWriter::SetFormat(VTFImageFormat format) {
+    bool automatic = (format == IMAGE_FORMAT_AUTO || format == IMAGE_FORMAT_AUTO_LOSSLESS);
+    m_autoFormat = automatic ? format : IMAGE_FORMAT_NONE;
+    m_formatResolved = false;
+    m_format = (format == IMAGE_FORMAT_AUTO) ? IMAGE_FORMAT_DXT5
+             : (format == IMAGE_FORMAT_AUTO_LOSSLESS) ? IMAGE_FORMAT_RGBA8888 : format;
+}
+
+// Picks the automatic format from the source, once per image
+inline void VTFWriter::ResolveFormat() {
+    if (m_autoFormat == IMAGE_FORMAT_NONE || m_formatResolved) return;
+    
+    m_alphaClass = ClassifyAlpha();
+    bool alpha = m_alphaClass != ALPHA_CLASS_OPAQUE;
+    if (m_autoFormat == IMAGE_FORMAT_AUTO_LOSSLESS) {
+        if (IsGrayscale()) {
+            m_format = alpha ? IMAGE_FORMAT_IA88 : IMAGE_FORMAT_I8;
+        } else {
+            m_format = alpha ? IMAGE_FORMAT_RGBA8888 : IMAGE_FORMAT_RGB888;
+        }
+    } else {
+        switch (m_alphaClass) {
+            case ALPHA_CLASS_OPAQUE:  m_format = IMAGE_FORMAT_DXT1; break;
+            case ALPHA_CLASS_ONEBIT:  m_format = IMAGE_FORMAT_DXT1_ONEBITALPHA; break;
+            default:                  m_format = IMAGE_FORMAT_DXT5; break;
+        }
+    }
+    m_formatResolved = true;
+}
+
+// Alpha class of the source image. Rows are split across the worker pool
+// and each band is one VTFClassifyAlpha pass.
+inline VTFAlphaClass VTFWriter::ClassifyAlpha() const {
+    if (!m_hasAlpha) return ALPHA_CLASS_OPAQUE;
+    
+    std::atomic<int> result(ALPHA_CLASS_OPAQUE);
+    VTFThreadPool::ParallelFor(m_height, 64, [&](int rowBegin, int rowEnd) {
+        if (result.load(std::memory_order_relaxed) == ALPHA_CLASS_EIGHTBIT) return;
+        
+        const uint8_t* band = m_sourceRGBA.data() + static_cast<size_t>(rowBegin) * m_width * 4;
+        int bandClass = VTFClassifyAlpha<VTFLayout::RGBA8888>(band, static_cast<size_t>(rowEnd - rowBegin) * m_width);
+        int current = result.load(std::memory_order_relaxed);
+        while (bandClass > current && !result.compare_exchange_weak(current, bandClass)) {}
+    });
+    
+    return static_cast<VTFAlphaClass>(result.load());
+}
+
+// Whether R, G and B are equal in every source pixel, one
+// VTFPixelsGrayscale pass per band of rows
+inline bool VTFWriter::IsGrayscale() const {
+    std::atomic<bool> color(false);
+    VTFThreadPool::ParallelFor(m_height, 64, [&](int rowBegin, int rowEnd) {
+        if (color.load(std::memory_order_relaxed)) return;
+        
+        const uint8_t* band = m_sourceRGBA.data() + static_cast<size_t>(rowBegin) * m_width * 4;
+        if (!VTFPixelsGrayscale<VTFLayout::RGBA8888>(band, static_cast<size_t>(rowEnd - rowBegin) * m_width)) {
+            color.store(true, std::memory_order_relaxed);
+        }
+    });
+    
+    return !color.load();
+}
+
+inline int VTFWriter::CalculateMipmapCount(int width, int height) const {
     int count = 1;
     while (width > 1 || height > 1) {
         width = (width > 1) ? width / 2 : 1;
@@ -209,310 +467,432 @@ inline int VTFWriter::CalculateMipmapCount(int width, int height) {
     return count;
 }
 
+inline void VTFWriter::Trim(size_t maxBytes) {
+    if (m_sourceRGBA.capacity() > maxBytes) VTFByteVector().swap(m_sourceRGBA);
+    if (m_compressed.capacity() > maxBytes) VTFByteVector().swap(m_compressed);
+    for (auto& mip : m_mipmaps) {
+        if (mip.capacity() > maxBytes) {
+            VTFByteVector().swap(mip);
+            m_incrementalValid = false;
+        }
+    }
+    for (auto& mip : m_encodedMips) {
+        if (mip.capacity() > maxBytes) {
+            VTFByteVector().swap(mip);
+            m_incrementalValid = false;
+        }
+    }
+}
+
+inline void VTFWriter::SetIncremental(bool incremental) {
+    m_incremental = incremental;
+    if (!incremental) {
+        m_incrementalValid = false;
+        std::vector<uint64_t>().swap(m_blockHashes);
+        std::vector<VTFByteVector>().swap(m_encodedMips);
+    }
+}
+
+inline const uint8_t* VTFWriter::GetMipData(int mip) const {
+    return (mip == 0) ? m_sourceRGBA.data() : m_mipmaps[mip - 1].data();
+}
+
 inline void VTFWriter::GenerateMipmaps() {
-    m_mipmaps.clear();
-    
-    // Start with original
-    m_mipmaps.push_back(m_sourceRGBA);
-    
-    if (!m_generateMipmaps) return;
+    m_mipCount = m_generateMipmaps ? CalculateMipmapCount(m_width, m_height) : 1;
+    if (static_cast<int>(m_mipmaps.size()) < m_mipCount - 1) {
+        m_mipmaps.resize(m_mipCount - 1);
+    }
     
     int mipWidth = m_width;
     int mipHeight = m_height;
     
-    while (mipWidth > 1 || mipHeight > 1) {
+    for (int mip = 1; mip < m_mipCount; mip++) {
         int newWidth = (mipWidth > 1) ? mipWidth / 2 : 1;
         int newHeight = (mipHeight > 1) ? mipHeight / 2 : 1;
         
-        const std::vector<uint8_t>& src = m_mipmaps.back();
-        std::vector<uint8_t> dst(newWidth * newHeight * 4);
+        m_mipmaps[mip - 1].resize(static_cast<size_t>(newWidth) * newHeight * 4);
         
-        // Simple box filter downscale
-        for (int y = 0; y < newHeight; y++) {
-            for (int x = 0; x < newWidth; x++) {
-                int srcX = x * 2;
-                int srcY = y * 2;
-                
-                // Average 2x2 block
-                for (int c = 0; c < 4; c++) {
-                    int sum = 0;
-                    int count = 0;
-                    
-                    for (int dy = 0; dy < 2 && srcY + dy < mipHeight; dy++) {
-                        for (int dx = 0; dx < 2 && srcX + dx < mipWidth; dx++) {
-                            sum += src[((srcY + dy) * mipWidth + (srcX + dx)) * 4 + c];
-                            count++;
-                        }
-                    }
-                    
-                    dst[(y * newWidth + x) * 4 + c] = sum / count;
-                }
-            }
-        }
+        // Simple box filter downscale, rows split across the worker pool
+        VTFThreadPool::ParallelFor(newHeight, 64, [&](int rowBegin, int rowEnd) {
+            DownsampleRect(mip, 0, rowBegin, newWidth, rowEnd);
+        });
         
-        m_mipmaps.push_back(std::move(dst));
         mipWidth = newWidth;
         mipHeight = newHeight;
     }
 }
 
-inline void VTFWriter::CompressImage(const uint8_t* rgba, int width, int height, std::vector<uint8_t>& output) {
-    if (m_format == IMAGE_FORMAT_DXT1 || m_format == IMAGE_FORMAT_DXT1_ONEBITALPHA) {
-        int blocksX = (width + 3) / 4;
-        int blocksY = (height + 3) / 4;
-        output.resize(blocksX * blocksY * 8);
-        
-        uint8_t block[64]; // 4x4 pixels * 4 bytes
-        
-        for (int by = 0; by < blocksY; by++) {
-            for (int bx = 0; bx < blocksX; bx++) {
-                // Extract 4x4 block
-                for (int y = 0; y < 4; y++) {
-                    for (int x = 0; x < 4; x++) {
-                        int srcX = bx * 4 + x;
-                        int srcY = by * 4 + y;
-                        if (srcX < width && srcY < height) {
-                            memcpy(&block[(y * 4 + x) * 4], &rgba[(srcY * width + srcX) * 4], 4);
-                        } else {
-                            memset(&block[(y * 4 + x) * 4], 0, 4);
-                        }
+// Box filters the pixels [x0, x1) x [y0, y1) of 'mip' from the mip below
+inline void VTFWriter::DownsampleRect(int mip, int x0, int y0, int x1, int y1) {
+    int srcWidth = (m_width >> (mip - 1)) > 1 ? m_width >> (mip - 1) : 1;
+    int srcHeight = (m_height >> (mip - 1)) > 1 ? m_height >> (mip - 1) : 1;
+    int dstWidth = (srcWidth > 1) ? srcWidth / 2 : 1;
+    
+    const uint8_t* src = GetMipData(mip - 1);
+    uint8_t* dst = m_mipmaps[mip - 1].data();
+    
+    for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < x1; x++) {
+            int srcX = x * 2;
+            int srcY = y * 2;
+            
+            // Average 2x2 block
+            for (int c = 0; c < 4; c++) {
+                int sum = 0;
+                int count = 0;
+                
+                for (int dy = 0; dy < 2 && srcY + dy < srcHeight; dy++) {
+                    for (int dx = 0; dx < 2 && srcX + dx < srcWidth; dx++) {
+                        sum += src[(static_cast<size_t>(srcY + dy) * srcWidth + (srcX + dx)) * 4 + c];
+                        count++;
                     }
                 }
                 
-                DXTCompress::CompressDXT1Block(block, &output[(by * blocksX + bx) * 8]);
+                dst[(static_cast<size_t>(y) * dstWidth + x) * 4 + c] = sum / count;
             }
         }
     }
-    else if (m_format == IMAGE_FORMAT_DXT5) {
+}
+
+// Encodes the 4x4 tile (bx, by) of an image. DXT formats write one block;
+// uncompressed formats write the tile's pixels into a full-image layout.
+inline void VTFWriter::EncodeBlock(const uint8_t* rgba, int width, int height, int bx, int by, uint8_t* output) {
+    if (m_format == IMAGE_FORMAT_DXT1 || m_format == IMAGE_FORMAT_DXT1_ONEBITALPHA ||
+        m_format == IMAGE_FORMAT_DXT5) {
+        // Extract 4x4 block
+        uint8_t block[64]; // 4x4 pixels * 4 bytes
+        DXTCompress::GatherBlock(rgba, width, height, bx, by, block);
+        
+        size_t blockBytes = GetFormatTraits(m_format).bytesPerBlock;
+        if (m_blockCache && m_blockCache->Lookup(block, m_format, output, blockBytes)) return;
+        
+        if (m_format == IMAGE_FORMAT_DXT5) {
+            DXTCompress::CompressDXT5Block(block, output);
+        } else if (m_format == IMAGE_FORMAT_DXT1_ONEBITALPHA) {
+            DXTCompress::CompressDXT1ABlock(block, output);
+        } else {
+            DXTCompress::CompressDXT1Block(block, output);
+        }
+        
+        if (m_blockCache) m_blockCache->Store(block, m_format, output, blockBytes);
+    } else {
+        int bpp = GetBytesPerPixel(m_format);
+        int x0 = bx * 4;
+        int pixels = (width - x0 < 4) ? width - x0 : 4;
+        for (int y = by * 4; y < by * 4 + 4 && y < height; y++) {
+            size_t offset = static_cast<size_t>(y) * width + x0;
+            ConvertFromRGBA(rgba + offset * 4, output + offset * bpp, pixels, 1);
+        }
+    }
+}
+
+inline void VTFWriter::CompressImage(const uint8_t* rgba, int width, int height, VTFByteVector& output) {
+    if (m_format == IMAGE_FORMAT_DXT1 || m_format == IMAGE_FORMAT_DXT1_ONEBITALPHA ||
+        m_format == IMAGE_FORMAT_DXT5) {
         int blocksX = (width + 3) / 4;
         int blocksY = (height + 3) / 4;
-        output.resize(blocksX * blocksY * 16);
+        int blockBytes = GetFormatTraits(m_format).bytesPerBlock;
+        output.resize(static_cast<size_t>(blocksX) * blocksY * blockBytes);
         
-        uint8_t block[64];
-        
-        for (int by = 0; by < blocksY; by++) {
-            for (int bx = 0; bx < blocksX; bx++) {
-                // Extract 4x4 block
-                for (int y = 0; y < 4; y++) {
-                    for (int x = 0; x < 4; x++) {
-                        int srcX = bx * 4 + x;
-                        int srcY = by * 4 + y;
-                        if (srcX < width && srcY < height) {
-                            memcpy(&block[(y * 4 + x) * 4], &rgba[(srcY * width + srcX) * 4], 4);
-                        } else {
-                            memset(&block[(y * 4 + x) * 4], 0, 4);
-                        }
-                    }
+        // Block rows are independent, so they are split across the worker pool
+        VTFThreadPool::ParallelFor(blocksY, 4, [&](int rowBegin, int rowEnd) {
+            for (int by = rowBegin; by < rowEnd; by++) {
+                for (int bx = 0; bx < blocksX; bx++) {
+                    uint8_t* dst = &output[(static_cast<size_t>(by) * blocksX + bx) * blockBytes];
+                    EncodeBlock(rgba, width, height, bx, by, dst);
                 }
-                
-                DXTCompress::CompressDXT5Block(block, &output[(by * blocksX + bx) * 16]);
             }
-        }
+        });
     }
     else {
         // Uncompressed formats
-        ConvertFromRGBA(rgba, nullptr, width, height);
-        output.resize(width * height * GetBytesPerPixel(m_format));
+        output.resize(static_cast<size_t>(width) * height * GetBytesPerPixel(m_format));
         ConvertFromRGBA(rgba, output.data(), width, height);
     }
 }
 
 inline void VTFWriter::ConvertFromRGBA(const uint8_t* rgba, uint8_t* dst, int width, int height) {
-    int pixelCount = width * height;
-    
-    switch (m_format) {
-        case IMAGE_FORMAT_RGBA8888:
-            if (dst) memcpy(dst, rgba, pixelCount * 4);
-            break;
-            
-        case IMAGE_FORMAT_BGRA8888:
-            if (dst) {
-                for (int i = 0; i < pixelCount; i++) {
-                    dst[i*4 + 0] = rgba[i*4 + 2]; // B
-                    dst[i*4 + 1] = rgba[i*4 + 1]; // G
-                    dst[i*4 + 2] = rgba[i*4 + 0]; // R
-                    dst[i*4 + 3] = rgba[i*4 + 3]; // A
-                }
-            }
-            break;
-            
-        case IMAGE_FORMAT_RGB888:
-            if (dst) {
-                for (int i = 0; i < pixelCount; i++) {
-                    dst[i*3 + 0] = rgba[i*4 + 0];
-                    dst[i*3 + 1] = rgba[i*4 + 1];
-                    dst[i*3 + 2] = rgba[i*4 + 2];
-                }
-            }
-            break;
-            
-        case IMAGE_FORMAT_BGR888:
-            if (dst) {
-                for (int i = 0; i < pixelCount; i++) {
-                    dst[i*3 + 0] = rgba[i*4 + 2]; // B
-                    dst[i*3 + 1] = rgba[i*4 + 1]; // G
-                    dst[i*3 + 2] = rgba[i*4 + 0]; // R
-                }
-            }
-            break;
-            
-        default:
-            break;
-    }
+    VTFConvertToFormat<VTFLayout::RGBA8888>(m_format, rgba, dst, static_cast<size_t>(width) * height);
 }
 
-inline bool VTFWriter::Write(const char* filename) {
-    std::ofstream file(filename, std::ios::binary);
-    if (!file.is_open()) {
-        m_error = "Failed to open file for writing";
-        return false;
-    }
-    
-    // Generate mipmaps
-    GenerateMipmaps();
-    
-    // Build VTF header
-    VTFHeader header = {};
+inline void VTFWriter::BuildHeader(VTFHeader& header) const {
+    header = VTFHeader();
     header.signature[0] = 'V';
     header.signature[1] = 'T';
     header.signature[2] = 'F';
     header.signature[3] = '\0';
     header.version[0] = 7;
     header.version[1] = 2;
-    header.headerSize = 80; // Version 7.2 require 80 bytes header (padded)
+    header.headerSize = 80; // Version 7.2 requires 80 bytes header (padded)
     header.width = static_cast<uint16_t>(m_width);
     header.height = static_cast<uint16_t>(m_height);
-    header.flags = m_flags;
+    
+    // Only one face is written, and the alpha flags follow the data: the
+    // format's alpha, or what the image uses when the format was chosen
+    header.flags = m_flags & ~(TEXTUREFLAGS_ENVMAP | TEXTUREFLAGS_ONEBITALPHA | TEXTUREFLAGS_EIGHTBITALPHA);
+    if (m_autoFormat != IMAGE_FORMAT_NONE) {
+        if (m_alphaClass == ALPHA_CLASS_ONEBIT) header.flags |= TEXTUREFLAGS_ONEBITALPHA;
+        if (m_alphaClass == ALPHA_CLASS_EIGHTBIT) header.flags |= TEXTUREFLAGS_EIGHTBITALPHA;
+    } else {
+        header.flags |= GetFormatAlphaFlags(m_format);
+    }
     header.frames = 1;
     header.firstFrame = 0;
-    header.reflectivity[0] = 0.5f;
-    header.reflectivity[1] = 0.5f;
-    header.reflectivity[2] = 0.5f;
+    header.reflectivity[0] = m_reflectivity[0];
+    header.reflectivity[1] = m_reflectivity[1];
+    header.reflectivity[2] = m_reflectivity[2];
     header.bumpmapScale = 1.0f;
     header.highResImageFormat = static_cast<uint32_t>(m_format);
-    header.mipmapCount = static_cast<uint8_t>(m_mipmaps.size());
+    header.mipmapCount = static_cast<uint8_t>(m_generateMipmaps ? CalculateMipmapCount(m_width, m_height) : 1);
     header.lowResImageFormat = IMAGE_FORMAT_NONE;
     header.lowResImageWidth = 0;
     header.lowResImageHeight = 0;
     header.depth = 1;
+}
+
+inline size_t VTFWriter::CalculateFileSize() {
+    ResolveFormat();
+    int mipCount = m_generateMipmaps ? CalculateMipmapCount(m_width, m_height) : 1;
     
-    // Write header (full struct is 80 bytes padded)
-    file.write(reinterpret_cast<const char*>(&header), sizeof(VTFHeader));
-    
-    // Write mipmaps (smallest to largest, as per VTF spec)
-    for (int mip = static_cast<int>(m_mipmaps.size()) - 1; mip >= 0; mip--) {
-        int mipWidth = m_width >> mip;
-        int mipHeight = m_height >> mip;
-        if (mipWidth < 1) mipWidth = 1;
-        if (mipHeight < 1) mipHeight = 1;
-        
-        std::vector<uint8_t> compressed;
-        CompressImage(m_mipmaps[mip].data(), mipWidth, mipHeight, compressed);
-        file.write(reinterpret_cast<const char*>(compressed.data()), compressed.size());
+    size_t size = sizeof(VTFHeader);
+    for (int mip = 0; mip < mipCount; mip++) {
+        size += CalculateImageSize(m_width >> mip, m_height >> mip, m_format);
     }
-    
-    return true;
+    return size;
 }
 
-inline bool VTFWriter::Write(const wchar_t* filename) {
-    std::ofstream file(filename, std::ios::binary);
-    if (!file.is_open()) {
-        m_error = "Failed to open file for writing";
-        return false;
+inline bool VTFWriter::WriteSegments(const SegmentSink& sink) {
+    m_error.clear();
+    ResolveFormat();
+    
+    if (!m_incremental) {
+        GenerateMipmaps();
     }
     
-    // Same implementation as char* version
-    GenerateMipmaps();
+    // Header (full struct is 80 bytes padded)
+    VTFHeader header;
+    BuildHeader(header);
+    if (!sink(reinterpret_cast<const uint8_t*>(&header), sizeof(VTFHeader))) {
+        m_error = "Failed to write header";
+        return false;
+    }
     
-    VTFHeader header = {};
-    header.signature[0] = 'V';
-    header.signature[1] = 'T';
-    header.signature[2] = 'F';
-    header.signature[3] = '\0';
-    header.version[0] = 7;
-    header.version[1] = 2;
-    header.headerSize = 80; // Version 7.2 require 80 bytes header (padded)
-    header.width = static_cast<uint16_t>(m_width);
-    header.height = static_cast<uint16_t>(m_height);
-    header.flags = m_flags;
-    header.frames = 1;
-    header.firstFrame = 0;
-    header.reflectivity[0] = 0.5f;
-    header.reflectivity[1] = 0.5f;
-    header.reflectivity[2] = 0.5f;
-    header.bumpmapScale = 1.0f;
-    header.highResImageFormat = static_cast<uint32_t>(m_format);
-    header.mipmapCount = static_cast<uint8_t>(m_mipmaps.size());
-    header.lowResImageFormat = IMAGE_FORMAT_NONE;
-    header.lowResImageWidth = 0;
-    header.lowResImageHeight = 0;
-    header.depth = 1;
+    // Incremental writes update the retained mips and output in place,
+    // streaming each band as it is brought up to date
+    if (m_incremental) {
+        return UpdateIncremental(sink);
+    }
     
-    file.write(reinterpret_cast<const char*>(&header), sizeof(VTFHeader));
+    // Mipmaps (smallest to largest, as per VTF spec). Large mips are encoded
+    // in bands of rows so output can be written while the rest encodes.
+    const int bandRows = 256;
+    m_encodedBlockCount = 0;
     
-    for (int mip = static_cast<int>(m_mipmaps.size()) - 1; mip >= 0; mip--) {
+    for (int mip = m_mipCount - 1; mip >= 0; mip--) {
         int mipWidth = m_width >> mip;
         int mipHeight = m_height >> mip;
         if (mipWidth < 1) mipWidth = 1;
         if (mipHeight < 1) mipHeight = 1;
         
-        std::vector<uint8_t> compressed;
-        CompressImage(m_mipmaps[mip].data(), mipWidth, mipHeight, compressed);
-        file.write(reinterpret_cast<const char*>(compressed.data()), compressed.size());
+        for (int row = 0; row < mipHeight; row += bandRows) {
+            int rows = (mipHeight - row < bandRows) ? mipHeight - row : bandRows;
+            const uint8_t* band = GetMipData(mip) + static_cast<size_t>(row) * mipWidth * 4;
+            
+            CompressImage(band, mipWidth, rows, m_compressed);
+            m_encodedBlockCount += static_cast<size_t>((mipWidth + 3) / 4) * ((rows + 3) / 4);
+            if (!sink(m_compressed.data(), m_compressed.size())) {
+                m_error = "Failed to write image data";
+                return false;
+            }
+        }
     }
     
     return true;
 }
 
-inline bool VTFWriter::WriteToMemory(std::vector<uint8_t>& output) {
-    output.clear();
+// Brings the retained mips and encoded output up to date with the source,
+// re-encoding only dirty blocks, and hands the output to the sink smallest
+// mip first in bands of block rows. Falls back to a full encode when the
+// layout changed or there is no previous write to build on.
+inline bool VTFWriter::UpdateIncremental(const SegmentSink& sink) {
+    int mipCount = m_generateMipmaps ? CalculateMipmapCount(m_width, m_height) : 1;
+    bool full = !m_incrementalValid || m_prevWidth != m_width || m_prevHeight != m_height ||
+                m_prevMipCount != mipCount || m_prevFormat != m_format;
+    
+    // On a full pass every block is dirty, so the mips are filtered below
+    if (full) {
+        m_mipCount = mipCount;
+        if (static_cast<int>(m_mipmaps.size()) < m_mipCount - 1) {
+            m_mipmaps.resize(m_mipCount - 1);
+        }
+        for (int mip = 1; mip < m_mipCount; mip++) {
+            int mipWidth = (m_width >> mip) > 1 ? m_width >> mip : 1;
+            int mipHeight = (m_height >> mip) > 1 ? m_height >> mip : 1;
+            m_mipmaps[mip - 1].resize(static_cast<size_t>(mipWidth) * mipHeight * 4);
+        }
+        m_encodedMips.resize(m_mipCount);
+    }
     
-    // Generate mipmaps
-    GenerateMipmaps();
+    // Until every band is written the retained output is out of step with
+    // the hashes, so a failed write leaves the next one to start over
+    m_incrementalValid = false;
     
-    // Build VTF header
-    VTFHeader header = {};
-    header.signature[0] = 'V';
-    header.signature[1] = 'T';
-    header.signature[2] = 'F';
-    header.signature[3] = '\0';
-    header.version[0] = 7;
-    header.version[1] = 2;
-    header.headerSize = 80; // Version 7.2 requires 80 bytes header (padded)
-    header.width = static_cast<uint16_t>(m_width);
-    header.height = static_cast<uint16_t>(m_height);
-    header.flags = m_flags;
-    header.frames = 1;
-    header.firstFrame = 0;
-    header.reflectivity[0] = 0.5f;
-    header.reflectivity[1] = 0.5f;
-    header.reflectivity[2] = 0.5f;
-    header.bumpmapScale = 1.0f;
-    header.highResImageFormat = static_cast<uint32_t>(m_format);
-    header.mipmapCount = static_cast<uint8_t>(m_mipmaps.size());
-    header.lowResImageFormat = IMAGE_FORMAT_NONE;
-    header.lowResImageWidth = 0;
-    header.lowResImageHeight = 0;
-    header.depth = 1;
+    // Hash every 4x4 block of the source; changed hashes mark dirty blocks
+    int blocksX = (m_width + 3) / 4;
+    int blocksY = (m_height + 3) / 4;
+    std::vector<uint64_t> hashes(static_cast<size_t>(blocksX) * blocksY);
+    std::vector<std::vector<uint8_t>> dirty(m_mipCount);
+    dirty[0].resize(hashes.size());
     
-    // Write header to output
-    output.resize(sizeof(VTFHeader)); // Use full struct size (80)
-    memcpy(output.data(), &header, sizeof(VTFHeader));
+    VTFThreadPool::ParallelFor(blocksY, 16, [&](int rowBegin, int rowEnd) {
+        for (int by = rowBegin; by < rowEnd; by++) {
+            for (int bx = 0; bx < blocksX; bx++) {
+                int x0 = bx * 4;
+                int pixels = (m_width - x0 < 4) ? m_width - x0 : 4;
+                
+                VTFHash hash;
+                for (int y = by * 4; y < by * 4 + 4 && y < m_height; y++) {
+                    hash.Update(&m_sourceRGBA[(static_cast<size_t>(y) * m_width + x0) * 4], pixels * 4);
+                }
+                
+                size_t index = static_cast<size_t>(by) * blocksX + bx;
+                hashes[index] = hash.Digest();
+                dirty[0][index] = full || hashes[index] != m_blockHashes[index];
+            }
+        }
+    });
+    
+    // Refilter the dirty regions of each mip from the one below it. Mips
+    // depend on each other largest first but are written smallest first,
+    // so this pass runs to completion before any encoding.
+    for (int mip = 1; mip < m_mipCount; mip++) {
+        int mipWidth = (m_width >> mip) > 1 ? m_width >> mip : 1;
+        int mipHeight = (m_height >> mip) > 1 ? m_height >> mip : 1;
+        int mipBlocksX = (mipWidth + 3) / 4;
+        int mipBlocksY = (mipHeight + 3) / 4;
+        
+        // A block of this mip is filtered from the 2x2 blocks below it
+        int prevBlocksX = ((m_width >> (mip - 1)) > 1 ? (m_width >> (mip - 1)) + 3 : 4) / 4;
+        int prevBlocksY = ((m_height >> (mip - 1)) > 1 ? (m_height >> (mip - 1)) + 3 : 4) / 4;
+        std::vector<uint8_t>& mipDirty = dirty[mip];
+        mipDirty.assign(static_cast<size_t>(mipBlocksX) * mipBlocksY, 0);
+        
+        for (int by = 0; by < prevBlocksY; by++) {
+            for (int bx = 0; bx < prevBlocksX; bx++) {
+                if (!dirty[mip - 1][static_cast<size_t>(by) * prevBlocksX + bx]) continue;
+                int ux = (bx / 2 < mipBlocksX) ? bx / 2 : mipBlocksX - 1;
+                int uy = (by / 2 < mipBlocksY) ? by / 2 : mipBlocksY - 1;
+                mipDirty[static_cast<size_t>(uy) * mipBlocksX + ux] = 1;
+            }
+        }
+        
+        VTFThreadPool::ParallelFor(mipBlocksY, 4, [&](int rowBegin, int rowEnd) {
+            for (int by = rowBegin; by < rowEnd; by++) {
+                for (int bx = 0; bx < mipBlocksX; bx++) {
+                    if (!mipDirty[static_cast<size_t>(by) * mipBlocksX + bx]) continue;
+                    
+                    int x0 = bx * 4;
+                    int x1 = (x0 + 4 < mipWidth) ? x0 + 4 : mipWidth;
+                    int y0 = by * 4;
+                    int y1 = (y0 + 4 < mipHeight) ? y0 + 4 : mipHeight;
+                    DownsampleRect(mip, x0, y0, x1, y1);
+                }
+            }
+        });
+    }
     
-    // Write mipmaps (smallest to largest)
-    for (int mip = static_cast<int>(m_mipmaps.size()) - 1; mip >= 0; mip--) {
-        int mipWidth = m_width >> mip;
-        int mipHeight = m_height >> mip;
-        if (mipWidth < 1) mipWidth = 1;
-        if (mipHeight < 1) mipHeight = 1;
+    // Re-encode dirty blocks in bands of block rows (256 pixel rows, as in
+    // a regular write), writing each band out once it is up to date
+    const int bandBlockRows = 64;
+    bool compressed = GetFormatTraits(m_format).compressed;
+    int blockBytes = GetFormatTraits(m_format).bytesPerBlock;
+    m_encodedBlockCount = 0;
+    
+    for (int mip = m_mipCount - 1; mip >= 0; mip--) {
+        int mipWidth = (m_width >> mip) > 1 ? m_width >> mip : 1;
+        int mipHeight = (m_height >> mip) > 1 ? m_height >> mip : 1;
+        int mipBlocksX = (mipWidth + 3) / 4;
+        int mipBlocksY = (mipHeight + 3) / 4;
+        const std::vector<uint8_t>& mipDirty = dirty[mip];
         
-        std::vector<uint8_t> compressed;
-        CompressImage(m_mipmaps[mip].data(), mipWidth, mipHeight, compressed);
+        VTFByteVector& output = m_encodedMips[mip];
+        output.resize(CalculateImageSize(mipWidth, mipHeight, m_format));
+        size_t blockRowBytes = compressed ? static_cast<size_t>(mipBlocksX) * blockBytes
+                                          : static_cast<size_t>(mipWidth) * 4 * blockBytes;
         
-        size_t offset = output.size();
-        output.resize(offset + compressed.size());
-        memcpy(output.data() + offset, compressed.data(), compressed.size());
+        for (int band = 0; band < mipBlocksY; band += bandBlockRows) {
+            int bandEnd = (band + bandBlockRows < mipBlocksY) ? band + bandBlockRows : mipBlocksY;
+            
+            size_t encoded = 0;
+            std::mutex countMutex;
+            VTFThreadPool::ParallelFor(bandEnd - band, 4, [&](int rowBegin, int rowEnd) {
+                size_t count = 0;
+                for (int by = band + rowBegin; by < band + rowEnd; by++) {
+                    for (int bx = 0; bx < mipBlocksX; bx++) {
+                        if (!mipDirty[static_cast<size_t>(by) * mipBlocksX + bx]) continue;
+                        
+                        uint8_t* dst = compressed ? &output[(static_cast<size_t>(by) * mipBlocksX + bx) * blockBytes]
+                                                  : output.data();
+                        EncodeBlock(GetMipData(mip), mipWidth, mipHeight, bx, by, dst);
+                        count++;
+                    }
+                }
+                std::lock_guard<std::mutex> lock(countMutex);
+                encoded += count;
+            });
+            m_encodedBlockCount += encoded;
+            
+            size_t begin = band * blockRowBytes;
+            size_t end = bandEnd * blockRowBytes;
+            if (end > output.size()) end = output.size();
+            if (!sink(output.data() + begin, end - begin)) {
+                m_error = "Failed to write image data";
+                return false;
+            }
+        }
     }
     
+    m_blockHashes.swap(hashes);
+    m_prevWidth = m_width;
+    m_prevHeight = m_height;
+    m_prevMipCount = m_mipCount;
+    m_prevFormat = m_format;
+    m_incrementalValid = true;
     return true;
 }
+
+inline bool VTFWriter::Write(const char* filename) {
+    std::ofstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        m_error = "Failed to open file for writing";
+        return false;
+    }
+    
+    return WriteSegments([&file](const uint8_t* data, size_t size) {
+        file.write(reinterpret_cast<const char*>(data), size);
+        return file.good();
+    });
+}
+
+inline bool VTFWriter::Write(const wchar_t* filename) {
+    std::ofstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        m_error = "Failed to open file for writing";
+        return false;
+    }
+    
+    return WriteSegments([&file](const uint8_t* data, size_t size) {
+        file.write(reinterpret_cast<const char*>(data), size);
+        return file.good();
+    });
+}
+
+inline bool VTFWriter::WriteToMemory(std::vector<uint8_t>& output) {
+    output.clear();
+    output.reserve(CalculateFileSize());
+    
+    return WriteSegments([&output](const uint8_t* data, size_t size) {
+        output.insert(output.end(), data, data + size);
+        return true;
+    });
+}